@@ -1,23 +1,22 @@
+#define MJS_TIMER_POOL_SIZE 2                           // Enable setInterval()
+#define MJS_CFUNC_POOL_SIZE 8
 #include <mjs3.h>                    
 
-extern void myDelay(int x) { 
-  delay(x);
-}
-
 extern void myDigitalWrite(int x, int y) {
   digitalWrite(x, y);
 }
 
+struct mjs *vm;
+
 void setup() {
   pinMode(16, OUTPUT);                                  // Initialize the LED_BUILTIN pin as an output
   
-  struct mjs *vm = mjs_create();                        // Create JS instance
-  mjs_ffi(vm, "delay", (cfn_t) myDelay, "vi");          // Import delay()
+  vm = mjs_create();                                    // Create JS instance
   mjs_ffi(vm, "write", (cfn_t) myDigitalWrite, "vii");  // Import write()
   
-  mjs_eval(vm, "while (1) { write(16, 0); delay(500); write(16, 1); delay(500); }", -1);
+  mjs_eval(vm, "let on = 0; setInterval(function() { on = 1 - on; write(16, on); }, 500);", -1);
 }
 
 void loop() {
-  //delay(1000);
+  mjs_poll(vm, millis());                               // Run expired JS timers
 }
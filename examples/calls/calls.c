@@ -0,0 +1,75 @@
+// Calls JS event handlers from C with mjs_call(), and uses the strings and
+// objects they return. A result stays valid until the next script run or
+// call, which releases it. Build and run on Linux:
+//
+//    cc -I../../src calls.c -o calls -lm && ./calls
+
+#define NUM_CALLS 50
+#define MJS_OBJ_POOL_SIZE 8
+#define MJS_PROP_POOL_SIZE 32
+#define MJS_CFUNC_POOL_SIZE 2
+#define MJS_STRING_POOL_SIZE 512
+#include <mjs3.c>
+
+static const char *s_handlers =
+    "let label = function(t) { if (t > 30) return 'hot'; return 'cold'; };"
+    "let reading = function(t) { return {temp: t, state: label(t)}; };";
+
+int main(void) {
+  struct mjs *vm = mjs_create();
+  struct mjs_stats before, after;
+  int i, failed = 0;
+
+  if (mjs_eval(vm, s_handlers, -1) == MJS_ERROR) {
+    printf("eval: %s\n", vm->error_message);
+    return 1;
+  }
+  mjs_stats(vm, &before);
+
+  for (i = 0; i < NUM_CALLS; i++) {
+    val_t label = mjs_eval(vm, "label", -1), reading, res, arg, *state, *temp;
+    const char *s;
+    int t = 20 + i % 20;
+
+    // A string made by the handler
+    arg = mjs_mk_num(t);
+    if (mjs_call(vm, label, 1, &arg, &res) == MJS_ERROR) {
+      printf("call: %s\n", vm->error_message);
+      return 1;
+    }
+    s = mjs_to_str(vm, res, NULL);
+    if (strcmp(s, t > 30 ? "hot" : "cold") != 0) {
+      printf("call %d: label %s\n", i, s);
+      failed++;
+    }
+
+    // An object made by the handler, holding another string
+    reading = mjs_eval(vm, "reading", -1);
+    if (mjs_call(vm, reading, 1, &arg, &res) == MJS_ERROR) {
+      printf("call: %s\n", vm->error_message);
+      return 1;
+    }
+    state = findprop(vm, res, "state", 5);
+    temp = findprop(vm, res, "temp", 4);
+    s = state == NULL ? "" : mjs_to_str(vm, *state, NULL);
+    if (strcmp(s, t > 30 ? "hot" : "cold") != 0 || temp == NULL ||
+        mjs_to_float(*temp) != t) {
+      printf("call %d: reading %s\n", i, mjs_stringify(vm, res));
+      failed++;
+    }
+  }
+
+  // The next run releases the last result, nothing is left behind
+  mjs_eval(vm, "0", -1);
+  mjs_stats(vm, &after);
+  if (after.objs != before.objs || after.props != before.props ||
+      after.strings != before.strings) {
+    printf("leak: %d objs, %d props, %d string bytes\n",
+           after.objs - before.objs, after.props - before.props,
+           after.strings - before.strings);
+    failed++;
+  }
+  printf("%d calls: %s\n", NUM_CALLS, failed ? "FAILED" : "ok");
+  mjs_destroy(vm);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,112 @@
+// Checks control flow: break and continue, switch fall-through, return
+// from loops and switches, and short-circuit operators. Every script runs
+// three ways: in one go, sliced by the smallest execution budget so that
+// it gets suspended inside loops and switches, and compiled, run twice.
+// Build and run on Linux:
+//
+//    cc -I../../src flow.c -o flow -lm && ./flow
+//
+// Then again with -DMJS_SWITCH_CACHE_SIZE=0 -DMJS_SKIP_INDEX_SIZE=0 added,
+// to check the same without the code caches.
+
+#define MJS_OBJ_POOL_SIZE 16
+#define MJS_PROP_POOL_SIZE 64
+#define MJS_STRING_POOL_SIZE 1024
+#ifndef MJS_SWITCH_CACHE_SIZE
+#define MJS_SWITCH_CACHE_SIZE 4
+#endif
+#ifndef MJS_SKIP_INDEX_SIZE
+#define MJS_SKIP_INDEX_SIZE 64
+#endif
+#include <mjs3.c>
+
+// Scripts are blocks, so that a compiled one can run again without
+// redeclaring its variables. Numbers are floats, results stay below 2^24
+static const struct {
+  const char *name, *script;
+  double expected;
+  int depth;  // Minimum nesting a sliced run is suspended at
+} s_cases[] = {
+    {"nested loops",
+     "{ let s = 0; for (let i = 0; i < 4; i++) { for (let j = 0; j < 4; j++) {"
+     "  if (j === 2) continue; if (j === 3) break; s = s * 10 + j; }"
+     "  if (i === 2) break; } s }",
+     10101, 6},
+    {"switch in a loop",
+     "{ let s = 0, i = 0; while (i < 5) { i++; switch (i) {"
+     "  case 2: continue; case 4: break; default: s = s * 10 + i; }"
+     "  s = s * 10 + 9; } s }",
+     1939959, 5},
+    {"fall-through",
+     "{ let f = function(x) { let s = 0; switch (x) {"
+     "  case 1: s = s * 10 + 1; default: s = s * 10 + 7;"
+     "  case 2: s = s * 10 + 2; break; case 3: s = s * 10 + 3; }"
+     "  return s; }; f(1) * 10000 + f(9) * 100 + f(2) * 10 + f(3) }",
+     1727223, 2},
+    {"return from a loop",
+     "{ let f = function(n) { for (let i = 0; i < 10; i++) {"
+     "  if (i === n) return i * 10; } return -1; };"
+     "let g = function() { let i = 0; do { i++; if (i === 4) return i; }"
+     "  while (i < 10); return 0; }; f(3) + f(20) * 1000 + g() * 10000 }",
+     39030, 2},
+    {"return from a switch",
+     "{ let f = function(x) { let i = 0; while (true) { switch (x) {"
+     "  case 1: return 11; case 2: i++; if (i === 3) return 20 + i; } } };"
+     "f(1) * 100 + f(2) }",
+     1123, 2},
+    {"short-circuit",
+     "{ let n = 0; let t = function() { n = n * 10 + 1; return true; };"
+     "let f = function() { n = n * 10 + 2; return false; };"
+     "let r = (f() && t()) || (t() || f()) || f();"
+     "let u = 0 && t(), v = 1 || t(), w = 1 && f(); n * 10 + (r ? 1 : 0) }",
+     2121, 2},
+    {"suspended in for, do and switch",
+     "{ let s = 0; for (let i = 0; i < 5; i++) { switch (i % 3) {"
+     "  case 0: s += 1; case 1: s += 10; break;"
+     "  default: let j = 0; do { s += 100; j++; } while (j < 2); } } s }",
+     242, 7},
+};
+
+// Run a script in a new VM: 0 in one go, 1 sliced, 2 compiled
+static int run(int i, int how) {
+  struct mjs *vm = mjs_create();
+  val_t v;
+  int slices = 1, depth = 0, failed = 0, script = -1;
+  if (how == 1) mjs_set_budget(vm, 1);
+  if (how == 2) {
+    script = mjs_compile(vm, s_cases[i].script, -1);
+    v = script < 0 ? MJS_ERROR : mjs_run(vm, script);
+    if (v != MJS_ERROR) v = mjs_run(vm, script);
+  } else {
+    v = mjs_eval(vm, s_cases[i].script, -1);
+  }
+  while (v == MJS_SUSPENDED && slices < 10000) {
+    if (vm->resume.depth > depth) depth = vm->resume.depth;
+    v = mjs_resume(vm);
+    slices++;
+  }
+  if (v == MJS_ERROR || mjs_type(v) != MJS_TYPE_NUMBER ||
+      mjs_to_float(v) != s_cases[i].expected) {
+    printf("%s, %s: %s\n", s_cases[i].name,
+           how == 0 ? "one go" : how == 1 ? "sliced" : "compiled",
+           v == MJS_ERROR ? vm->error_message : mjs_stringify(vm, v));
+    failed++;
+  } else if (how == 1 && depth < s_cases[i].depth) {
+    printf("%s: suspended at depth %d, expected %d\n", s_cases[i].name,
+           depth, s_cases[i].depth);
+    failed++;
+  }
+  mjs_release(vm, script);
+  mjs_destroy(vm);
+  return failed;
+}
+
+int main(void) {
+  int i, how, failed = 0;
+  for (i = 0; i < (int) ARRSIZE(s_cases); i++) {
+    for (how = 0; how < 3; how++) failed += run(i, how);
+  }
+  printf("%d cases, switch cache %d, skip index %d: %s\n", i,
+         MJS_SWITCH_CACHE_SIZE, MJS_SKIP_INDEX_SIZE, failed ? "FAILED" : "ok");
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,84 @@
+// Compiles a set of rules once and runs them on every new sensor reading,
+// the way a device would from its loop(). The rules are then replaced with
+// new ones, more times than there are script handles, to check that
+// released handles get reused. Build and run on Linux:
+//
+//    cc -I../../src rules.c -o rules -lm && ./rules
+
+#define NUM_READINGS 100
+#define NUM_SWAPS 10
+#define MJS_SCRIPT_POOL_SIZE 2
+#define MJS_SWITCH_CACHE_SIZE 2
+#define MJS_SKIP_INDEX_SIZE 32
+#define MJS_OBJ_POOL_SIZE 8
+#define MJS_PROP_POOL_SIZE 32
+#define MJS_CFUNC_POOL_SIZE 4
+#define MJS_STRING_POOL_SIZE 512
+#include <mjs3.c>
+
+static const char *s_fan_rule =
+    "if (temp > 30) { fan(1); } if (temp < 25) { fan(0); }";
+static const char *s_mode_rule =
+    "switch (mode) { case 0: led(0); break; case 1: led(temp); break; "
+    "case 'blink': led(-1); break; default: led(-2); }";
+
+static int fan_on, led_value, failed;
+
+static void fan(int on) { fan_on = on; }
+static void led(int value) { led_value = value; }
+
+// What the rules are expected to do with a reading
+static int check(int temp, int mode, int fan_was_on) {
+  int fan_expected = temp > 30 ? 1 : temp < 25 ? 0 : fan_was_on;
+  int led_expected = mode == 0 ? 0 : mode == 1 ? temp : mode == 2 ? -1 : -2;
+  return fan_on == fan_expected && led_value == led_expected;
+}
+
+int main(void) {
+  struct mjs *vm = mjs_create();
+  int i, n, fan_rule = -1, mode_rule = -1;
+
+  mjs_ffi(vm, "fan", (cfn_t) fan, "vi");
+  mjs_ffi(vm, "led", (cfn_t) led, "vi");
+  // Assignment does not release the value it overwrites, so the strings
+  // the readings use are made once
+  mjs_eval(vm, "let temp = 0, mode = 0, BLINK = 'blink', OFF = 'off';", -1);
+
+  for (n = 0; n < NUM_SWAPS; n++) {
+    // Replace the rules, e.g. after an update from the cloud
+    mjs_release(vm, fan_rule);
+    mjs_release(vm, mode_rule);
+    fan_rule = mjs_compile(vm, s_fan_rule, -1);
+    mode_rule = mjs_compile(vm, s_mode_rule, -1);
+    if (fan_rule < 0 || mode_rule < 0) {
+      printf("compile: %s\n", vm->error_message);
+      return 1;
+    }
+
+    // The device loop: take a reading and run the rules on it
+    for (i = 0; i < NUM_READINGS; i++) {
+      char buf[64];
+      int temp = 20 + (i * 7) % 15, mode = i % 4, fan_was_on = fan_on;
+      snprintf(buf, sizeof(buf), "temp = %d; mode = %s;", temp,
+               mode == 2 ? "BLINK" : mode == 3 ? "OFF" : mode ? "1" : "0");
+      if (mjs_eval(vm, buf, -1) == MJS_ERROR ||
+          mjs_run(vm, fan_rule) == MJS_ERROR ||
+          mjs_run(vm, mode_rule) == MJS_ERROR) {
+        printf("run: %s\n", vm->error_message);
+        return 1;
+      }
+      if (!check(temp, mode, fan_was_on)) {
+        printf("swap %d, reading %d: fan %d, led %d\n", n, i, fan_on,
+               led_value);
+        failed++;
+      }
+    }
+  }
+
+  mjs_release(vm, fan_rule);
+  mjs_release(vm, mode_rule);
+  printf("%d rule swaps, %d readings: %s\n", NUM_SWAPS, NUM_READINGS,
+         failed ? "FAILED" : "ok");
+  mjs_destroy(vm);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,66 @@
+// Runs many cooperative tasks over a simulated clock and checks that every
+// task wakes up exactly when it asked to. Build and run on Linux:
+//
+//    cc -I../../src tasks.c -o tasks -lm && ./tasks
+
+#define NUM_TASKS 16
+#define NUM_ROUNDS 5
+#define MJS_TASK_POOL_SIZE NUM_TASKS
+#define MJS_OBJ_POOL_SIZE (NUM_TASKS + 4)
+#define MJS_PROP_POOL_SIZE (NUM_TASKS * 3 + 8)
+#define MJS_CFUNC_POOL_SIZE 8
+#define MJS_CALL_STACK_SIZE (NUM_TASKS + 8)
+#define MJS_STRING_POOL_SIZE 512
+#include <mjs3.c>
+
+static uint32_t now;
+static int wakeups[NUM_TASKS], failed;
+
+// Called by each task when it wakes up
+static void tick(int id, int period, int n) {
+  uint32_t expected = (uint32_t)(period * (n - 1));
+  if (id < 0 || id >= NUM_TASKS || now != expected) {
+    printf("task %d, round %d: woke up at %u, expected %u\n", id, n,
+           (unsigned) now, (unsigned) expected);
+    failed++;
+  } else {
+    wakeups[id]++;
+  }
+}
+
+int main(void) {
+  static char scripts[NUM_TASKS][128];
+  struct mjs *vm = mjs_create();
+  int i;
+
+  mjs_ffi(vm, "tick", (cfn_t) tick, "viii");
+  for (i = 0; i < NUM_TASKS; i++) {
+    // Every task sleeps for its own period, in its own block scope
+    snprintf(scripts[i], sizeof(scripts[i]),
+             "{ let n = 0; while (n - %d) { n += 1; tick(%d, %d, n); "
+             "sleep(%d); } }",
+             NUM_ROUNDS, i, (i + 1) * 10, (i + 1) * 10);
+    if (mjs_spawn(vm, scripts[i], -1) < 0) {
+      printf("spawn: %s\n", vm->error_message);
+      return 1;
+    }
+  }
+
+  // The host loop: advance the clock and let due tasks run
+  for (now = 0; now <= NUM_TASKS * NUM_ROUNDS * 10; now++) {
+    if (mjs_poll(vm, now) == MJS_ERROR) {
+      printf("poll: %s\n", vm->error_message);
+      return 1;
+    }
+  }
+
+  for (i = 0; i < NUM_TASKS; i++) {
+    if (wakeups[i] != NUM_ROUNDS) failed++;
+    if (vm->tasks[i].rs.buf != NULL) failed++;  // All tasks must be over
+  }
+  if (vm->csp != 1) failed++;  // Only the global scope is left
+  printf("%d tasks, %d rounds: %s\n", NUM_TASKS, NUM_ROUNDS,
+         failed ? "FAILED" : "ok");
+  mjs_destroy(vm);
+  return failed ? 1 : 0;
+}
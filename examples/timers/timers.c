@@ -0,0 +1,84 @@
+// Steps a simulated clock through timeouts and intervals that span several
+// timer wheel revolutions, once from zero and once across the wrap of the
+// 32-bit host clock, and checks that every timer fires in order and on time.
+// Build and run on Linux:
+//
+//    cc -I../../src timers.c -o timers -lm && ./timers
+
+#define MJS_TIMER_POOL_SIZE 8
+#define MJS_OBJ_POOL_SIZE 16
+#define MJS_PROP_POOL_SIZE 64
+#define MJS_CFUNC_POOL_SIZE 8
+#define MJS_STRING_POOL_SIZE 1024
+#include <mjs3.c>
+
+#define MAX_EVENTS 16
+
+// Timers set by the script below, with their delays relative to the start
+static const char *s_script =
+    "let n = 0;"
+    "let slow = setTimeout(function() { fired(9, 170); }, 170);"
+    "setTimeout(function() { fired(1, 5); }, 5);"
+    "setTimeout(function() { fired(2, 95); clearTimeout(slow); }, 95);"
+    "setTimeout(function() { fired(3, 250); }, 250);"
+    "let iv = setInterval(function() {"
+    "  n += 1; fired(4, n * 30); if (n === 4) clearInterval(iv); }, 30);";
+
+// Expected order of callbacks. Timer 9 is cleared before it is due
+static const int s_expected[] = {1, 4, 4, 4, 2, 4, 3};
+
+static uint32_t start, now;
+static int events[MAX_EVENTS], num_events, failed;
+
+// Called by every callback. A timer must fire on the first tick that starts
+// at or after its expiration time
+static void fired(int id, int ms) {
+  uint32_t late = now - (start + (uint32_t) ms);
+  if ((int32_t) late < 0 || late >= MJS_TIMER_TICK_MS) {
+    printf("start %lu: timer %d due at +%d fired at +%ld\n",
+           (unsigned long) start, id, ms, (long)(int32_t)(now - start));
+    failed++;
+  }
+  if (num_events < MAX_EVENTS) events[num_events] = id;
+  num_events++;
+}
+
+static int run(uint32_t from) {
+  struct mjs *vm = mjs_create();
+  int i, n = (int)(sizeof(s_expected) / sizeof(s_expected[0])), errors = failed;
+
+  num_events = 0;
+  start = now = from;
+  mjs_ffi(vm, "fired", (cfn_t) fired, "vii");
+  mjs_poll(vm, now);  // Let the VM know the time before setting timers
+  if (mjs_eval(vm, s_script, -1) == MJS_ERROR) {
+    printf("eval: %s\n", vm->error_message);
+    return 1;
+  }
+
+  // The host loop: advance the clock a millisecond at a time
+  for (; now - start <= 300; now++) {
+    if (mjs_poll(vm, now) == MJS_ERROR) {
+      printf("poll: %s\n", vm->error_message);
+      return 1;
+    }
+  }
+
+  if (num_events != n) failed++;
+  for (i = 0; i < n && i < num_events; i++) {
+    if (events[i] != s_expected[i]) failed++;
+  }
+  for (i = 0; i < MJS_TIMER_POOL_SIZE; i++) {
+    if (vm->timers[i].fn != MJS_UNDEFINED) failed++;  // All timers are over
+  }
+  printf("start %lu, %d timers fired: %s\n", (unsigned long) from, num_events,
+         failed > errors ? "FAILED" : "ok");
+  mjs_destroy(vm);
+  return failed > errors;
+}
+
+int main(void) {
+  int res = run(0);
+  res |= run((uint32_t) -120);  // The clock wraps in the middle of the run
+  return res;
+}
@@ -39,6 +39,77 @@
 #define MJS_CFUNC_POOL_SIZE 5
 #endif
 
+#ifndef MJS_TIMER_POOL_SIZE
+#define MJS_TIMER_POOL_SIZE 0  // Set to non-zero to enable setTimeout() & co
+#endif
+
+#ifndef MJS_TIMER_WHEEL_SIZE
+#define MJS_TIMER_WHEEL_SIZE 8  // Number of timer wheel slots, power of 2
+#endif
+
+#ifndef MJS_TIMER_TICK_MS
+#define MJS_TIMER_TICK_MS 10  // Timer wheel resolution, milliseconds
+#endif
+
+#ifndef MJS_RESUME_DEPTH
+#define MJS_RESUME_DEPTH 8  // Max nesting of statements a script can suspend in
+#endif
+
+#ifndef MJS_BUDGET_LIMIT
+#define MJS_BUDGET_LIMIT 100  // Fail code that overruns budget this many times
+#endif
+
+#ifndef MJS_TASK_POOL_SIZE
+#define MJS_TASK_POOL_SIZE 0  // Set to non-zero to enable mjs_spawn()
+#endif
+
+#ifndef MJS_SCRIPT_POOL_SIZE
+#define MJS_SCRIPT_POOL_SIZE 2
+#endif
+
+#ifndef MJS_PROFILE_SIZE
+#define MJS_PROFILE_SIZE 0  // Set to non-zero to enable the profiler
+#endif
+
+#ifndef MJS_PROFILE_FUNCS
+#define MJS_PROFILE_FUNCS 16  // Max number of profiled function names
+#endif
+
+#ifndef MJS_PROFILE_NAME_SIZE
+#define MJS_PROFILE_NAME_SIZE 16  // Profiled function names are cut to this
+#endif
+
+#ifndef MJS_HISTOGRAM_BUCKETS
+#define MJS_HISTOGRAM_BUCKETS 0  // Set to non-zero to enable latency histograms
+#endif
+
+#ifndef MJS_SWITCH_CACHE_SIZE
+#define MJS_SWITCH_CACHE_SIZE 0  // Set to non-zero to cache switch case tables
+#endif
+
+#ifndef MJS_SWITCH_CASES
+#define MJS_SWITCH_CASES 64  // Case table slots, power of 2
+#endif
+
+#ifndef MJS_SKIP_INDEX_SIZE
+#define MJS_SKIP_INDEX_SIZE 0  // Set to non-zero to index brackets for skipping
+#endif
+
+#ifndef MJS_SKIP_INDEX_BUFS
+#define MJS_SKIP_INDEX_BUFS 8  // Number of source buffers the index covers
+#endif
+
+// Caches of code locations, see code_gen()
+#define MJS_CODE_CACHES (MJS_SWITCH_CACHE_SIZE > 0 || MJS_SKIP_INDEX_SIZE > 0)
+
+#ifndef MJS_TRACE
+#define MJS_TRACE 0  // Set to 1 to enable binary tracing, see mjs_set_trace()
+#endif
+
+#ifndef MJS_LARGE_HEAP
+#define MJS_LARGE_HEAP 0  // Set to 1 for 32-bit indices and 64-bit values
+#endif
+
 #ifndef MJS_ERROR_MESSAGE_SIZE
 #define MJS_ERROR_MESSAGE_SIZE 40
 #endif
@@ -50,6 +121,7 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #if !defined(_MSC_VER) || _MSC_VER >= 1700
 #include <stdbool.h>
 #include <stdint.h>
@@ -72,7 +144,13 @@ typedef unsigned char uint8_t;
 
 #define mjs vm  // Aliasing `struct mjs` to `struct vm`
 
+#if MJS_LARGE_HEAP
+typedef uint64_t mjs_val_t;         // JS value placeholder
+typedef double mjs_num_t;           // JS number
+#else
 typedef uint32_t mjs_val_t;         // JS value placeholder
+typedef float mjs_num_t;            // JS number
+#endif
 typedef uint32_t mjs_len_t;         // String length placeholder
 typedef void (*mjs_cfn_t)(void);    // Native C function, for exporting to JS
 // typedef enum { CT_FLOAT = 0, CT_CHAR_PTR = 1 } mjs_ctype_t;  // C FFI types
@@ -80,27 +158,137 @@ typedef void (*mjs_cfn_t)(void);    // Native C function, for exporting to JS
 typedef mjs_val_t val_t;
 typedef mjs_len_t len_t;
 typedef mjs_cfn_t cfn_t;
+#if MJS_LARGE_HEAP
+typedef uint32_t ind_t;
+#else
 typedef uint16_t ind_t;
+#endif
 typedef uint32_t tok_t;
 #define INVALID_INDEX ((ind_t) ~0)
 
+// Sizes of VM pools and stacks, see mjs_create_in()
+struct mjs_config {
+  ind_t data_stack_size;   // Data stack size, values
+  ind_t call_stack_size;   // Call stack size, scopes
+  ind_t obj_pool_size;     // Objects pool size
+  ind_t prop_pool_size;    // Properties pool size
+  ind_t cfunc_pool_size;   // C functions pool size
+  ind_t string_pool_size;  // String pool size, bytes
+};
+
+// VM usage statistics, see mjs_stats(). Counters wrap around
+struct mjs_stats {
+  ind_t objs, objs_peak;              // Objects in use
+  ind_t props, props_peak;            // Properties in use
+  ind_t cfuncs;                       // C functions, these are never freed
+  ind_t strings, strings_peak;        // String pool bytes in use
+  ind_t stack, stack_peak;            // Data stack depth
+  ind_t call_stack, call_stack_peak;  // Call stack depth
+  uint32_t allocs;                    // Objects, props and strings created
+  uint32_t ooms;                      // Failed allocations
+  uint32_t abandons;                  // Values checked for release
+  uint32_t compactions;               // String pool compactions
+  uint32_t lookups;                   // Property lookups
+  uint32_t lookup_steps;              // Props visited by lookups
+  uint32_t ffi_calls;                 // C function calls
+};
+
+struct mjs;
+
+// An entry of the heap, reported by mjs_heap_walk()
+struct mjs_heap_item {
+  int kind;            // One of MJS_HEAP_* below
+  unsigned long id;    // Pool index, or string pool offset for strings
+  unsigned long size;  // Bytes taken by the entry, 0 for roots
+  mjs_val_t value;     // Entry value. Props: prop value
+  mjs_val_t key;       // Props: prop key
+  mjs_val_t owner;     // Props: object the prop belongs to
+};
+enum { MJS_HEAP_ROOT, MJS_HEAP_OBJ, MJS_HEAP_PROP, MJS_HEAP_STRING,
+       MJS_HEAP_CFUNC };
+#if MJS_HISTOGRAM_BUCKETS > 0
+// Latency histogram, in host clock units. Bucket 0 counts zero latencies,
+// bucket i counts latencies from 2^(i-1) up to 2^i, the last one the rest
+struct mjs_histogram {
+  uint32_t buckets[MJS_HISTOGRAM_BUCKETS];
+  uint32_t count;  // Number of measurements
+  uint32_t max;    // Longest latency seen
+};
+enum { MJS_HIST_EVAL, MJS_HIST_JS_CALL, MJS_HIST_C_CALL, MJS_HIST_CALLBACK,
+       MJS_HIST_MAX };
+#endif
+
+#if MJS_TRACE
+// Trace buffer layout: this header, followed by a ring of events. The buffer
+// can be saved as is, e.g. from a crash dump, and read by tools/trace.c
+struct mjs_trace_hdr {
+  uint32_t magic;  // MJS_TRACE_MAGIC
+  uint32_t size;   // Number of events the ring holds
+  uint32_t head;   // Events written so far, the last one is at (head-1)%size
+};
+struct mjs_trace_event {
+  uint32_t time;     // Host clock, see mjs_set_clock(), 0 if not set
+  uint16_t line;     // Line of the statement being run
+  uint8_t event;     // MJS_TRACE_* below
+  uint8_t type;      // Type of the value. For MJS_TRACE_OP, 0
+  uint16_t sp;       // Data stack pointer
+  uint16_t csp;      // Call stack pointer
+  uint32_t payload;  // Value payload: float bits for numbers, op for ops
+};
+#define MJS_TRACE_MAGIC 0x31534a4d  // "MJS1"
+enum { MJS_TRACE_STMT, MJS_TRACE_PUSH, MJS_TRACE_DROP, MJS_TRACE_OP,
+       MJS_TRACE_CALL, MJS_TRACE_FFI, MJS_TRACE_ERROR };
+#endif
+
+typedef void (*mjs_walk_cb_t)(struct mjs *, const struct mjs_heap_item *,
+                              void *ctx);
+
 static struct mjs *mjs_create(void);            // Create instance
+static struct mjs *mjs_create_in(void *mem, size_t size,
+                                 const struct mjs_config *);  // Create in mem
+static size_t mjs_arena_size(const struct mjs_config *);  // Memory needed
 static void mjs_destroy(struct mjs *);          // Destroy instance
 val_t mjs_get_global(struct mjs *);      // Get global namespace object
 static val_t mjs_eval(struct mjs *, const char *buf, int len);  // Evaluate expr
+static val_t mjs_call(struct mjs *, val_t fn, int argc, const val_t *argv,
+                      val_t *result);  // Call JS function
+static int mjs_compile(struct mjs *, const char *buf, int len);  // Validate
+static val_t mjs_run(struct mjs *, int script);  // Run compiled script
+static void mjs_release(struct mjs *, int script);  // Free compiled script
+static val_t mjs_poll(struct mjs *, uint32_t now_ms);  // Run timers, tasks
+static void mjs_set_budget(struct mjs *, int steps);  // Set execution budget
+static val_t mjs_resume(struct mjs *);  // Continue suspended script
+static int mjs_spawn(struct mjs *, const char *buf, int len);  // Start task
+static void mjs_stats(struct mjs *, struct mjs_stats *);  // Get statistics
+static void mjs_heap_walk(struct mjs *, mjs_walk_cb_t, void *ctx);  // Walk
+static void mjs_set_clock(struct mjs *, uint32_t (*fn)(void));  // Host clock
+static void mjs_profile_dump(struct mjs *, int collapsed,
+                             void (*out)(const char *line, void *ctx),
+                             void *ctx);     // Print profile
+static void mjs_profile_reset(struct mjs *);  // Clear profile
+#if MJS_TRACE
+static void mjs_set_trace(struct mjs *, void *buf, size_t size);  // Trace
+#endif
+#if MJS_HISTOGRAM_BUCKETS > 0
+static const struct mjs_histogram *mjs_histogram(struct mjs *,
+                                                 int kind);  // Get histogram
+static void mjs_histogram_reset(struct mjs *);  // Clear histograms
+#endif
+static val_t mjs_ffi(struct mjs *, const char *name, cfn_t fn,
+                     const char *decl);  // Import C function
 static val_t mjs_set(struct vm *, val_t obj, val_t key, val_t val);  // Set attribute
 const char *mjs_stringify(struct mjs *, val_t v);             // Stringify value
-unsigned long mjs_size(void);                          // Get VM size
+static unsigned long mjs_size(void);                   // Get VM size
 
 // Converting from C type to val_t
 // Use MJS_UNDEFINED, MJS_NULL, MJS_TRUE, MJS_FALSE for other scalar types
 val_t mjs_mk_obj(struct mjs *);
 val_t mjs_mk_str(struct mjs *, const char *, int len);
-val_t mjs_mk_num(float value);
+val_t mjs_mk_num(mjs_num_t value);
 val_t mjs_mk_js_func(struct mjs *, const char *, int len);
 
 // Converting from val_t to C/C++ types
-float mjs_to_float(val_t v);                         // Unpack number
+mjs_num_t mjs_to_float(val_t v);                     // Unpack number
 static char *mjs_to_str(struct mjs *, val_t, len_t *);      // Unpack string
 
 #define mjs_to_float(v) tof(v)
@@ -129,17 +317,33 @@ static char *mjs_to_str(struct mjs *, val_t, len_t *);      // Unpack string
 //  seeeeeee|emmmmmmm|mmmmmmmm|mmmmmmmm
 //  11111111|1ttttvvv|vvvvvvvv|vvvvvvvv
 //    INF     TYPE     PAYLOAD
+//
+// With MJS_LARGE_HEAP, values are 64bit doubles: 1 bit sign, 11 bits
+// exponent, 52 bits mantissa. Non-numbers have 48 bits of payload:
+//
+//  seeeeeee|eeeemmmm|mmmmmmmm|mmmmmmmm|... 4 more bytes
+//  11111111|1111tttt|vvvvvvvv|vvvvvvvv|...
+//     INF      TYPE  PAYLOAD
+
+#if MJS_LARGE_HEAP
+#define VAL_INF ((val_t) 0xfff0000000000000ULL)
+#define VAL_SHIFT 48
+#else
+#define VAL_INF ((val_t) 0xff800000)
+#define VAL_SHIFT 19
+#endif
 
-#define IS_FLOAT(v) (((v) &0xff800000) != 0xff800000)
-#define MK_VAL(t, p) (0xff800000 | ((val_t)(t) << 19) | (p))
-#define VAL_TYPE(v) ((mjs_type_t)(((v) >> 19) & 0x0f))
-#define VAL_PAYLOAD(v) ((v) & ~0xfff80000)
+#define IS_FLOAT(v) (((v) &VAL_INF) != VAL_INF)
+#define MK_VAL(t, p) (VAL_INF | ((val_t)(t) << VAL_SHIFT) | (p))
+#define VAL_TYPE(v) ((mjs_type_t)(((v) >> VAL_SHIFT) & 0x0f))
+#define VAL_PAYLOAD(v) ((v) & (((val_t) 1 << VAL_SHIFT) - 1))
 
 #define MJS_UNDEFINED MK_VAL(MJS_TYPE_UNDEFINED, 0)
 #define MJS_ERROR MK_VAL(MJS_TYPE_ERROR, 0)
 #define MJS_TRUE MK_VAL(MJS_TYPE_TRUE, 0)
 #define MJS_FALSE MK_VAL(MJS_TYPE_FALSE, 0)
 #define MJS_NULL MK_VAL(MJS_TYPE_NULL, 0)
+#define MJS_SUSPENDED MK_VAL(MJS_TYPE_ERROR, 1)  // Script ran out of budget
 
 #include <assert.h>
 #include <float.h>
@@ -158,13 +362,16 @@ typedef enum {
 } mjs_type_t;
 // clang-format on
 
-struct prop {
-  val_t key;
-  val_t val;
-  ind_t flags;  // see MJS_PROP_* below
-  ind_t next;   // index of the next prop, or INVALID_INDEX if last one
-};
-#define PROP_ALLOCATED 1
+// The parser pushes the left side of an assignment, or the operand of ++ and
+// --, as a reference to the property that holds it. The tag is internal and
+// never escapes an expression, so mjs_type_t does not list it
+#define MJS_TYPE_REF ((mjs_type_t) 11)
+#define MK_REF(ind) MK_VAL(MJS_TYPE_REF, (val_t)(ind))
+
+// Props are stored as a structure of arrays, see struct vm. A key scan walks
+// the `next` and `tags` arrays, and touches a key only if its tag matches.
+// A tag is a 7-bit hash of the key with PROP_ALLOCATED bit set, 0 if free
+#define PROP_ALLOCATED 0x80
 
 struct obj {
   ind_t flags;  // see MJS_OBJ_* defines below
@@ -178,17 +385,171 @@ struct cfunc {
   const char *decl;   // Declaration of return values and arguments
 };
 
+struct timer {
+  val_t fn;         // JS function to call, MJS_UNDEFINED if the slot is free
+  uint32_t expire;  // Expiration time, milliseconds
+  uint32_t period;  // Repeat period for setInterval(), 0 for setTimeout()
+  ind_t next;       // Next timer in the same wheel slot, or INVALID_INDEX
+  uint8_t slot;     // Wheel slot this timer is linked into
+  uint8_t flags;    // See TIMER_* below
+};
+#define TIMER_LINKED 1   // Timer sits in the wheel
+#define TIMER_RUNNING 2  // Timer callback is being called
+
+// Location of a suspended script: offsets of the statements being executed,
+// from the outermost to the innermost one. Scopes of the blocks these
+// statements sit in are moved off the call stack until the script resumes,
+// so that other scripts can run meanwhile.
+struct resume {
+  const char *buf;                 // Suspended script, NULL if none
+  len_t len;                       // Script length
+  len_t path[MJS_RESUME_DEPTH];    // Statement offsets
+  ind_t depth;                     // Number of statements in the path
+  ind_t pos;                       // Path entries matched while resuming
+  ind_t csp;                       // Call stack pointer when the script began
+  val_t scopes[MJS_RESUME_DEPTH];  // Scopes of the blocks it is suspended in
+  ind_t nscopes;                   // Number of saved scopes
+};
+
+// Task is a script that runs concurrently with other tasks, driven by
+// mjs_poll(). It gives up control by calling sleep() or yield(), or when it
+// runs out of budget.
+struct task {
+  struct resume rs;  // Where it sleeps. rs.buf is NULL if free
+  uint32_t wake;     // When to resume, host milliseconds
+};
+
+// Profile entry: executions and self time of a source line, in the context
+// of the statement that called the function this line belongs to
+struct prof {
+  ind_t parent;    // Entry of the calling statement, INVALID_INDEX at the top
+  uint16_t line;   // Line number, counted from the start of the function
+  uint8_t func;    // Index of the function name in vm->prof_funcs
+  uint8_t used;    // Non-zero if this slot is taken
+  uint32_t count;  // Executions
+  uint32_t time;   // Self time, host clock units
+};
+
+#if MJS_SWITCH_CACHE_SIZE > 0
+// Switch label: location of the code after `case`, or of the ':' after
+// `default`, or of the closing '}', relative to the switch body
+struct swcase {
+  uint32_t key;   // Integer case value, or hash of a string one
+  len_t off;      // Offset from the opening '{', 0 if the slot is empty
+  uint16_t line;  // Line number, counted from the opening '{'
+};
+
+// Case table of a switch statement, built on its first execution. It is
+// valid as long as the code it points to stays where it is, see code_gen()
+struct swtab {
+  const char *body;                       // Opening '{', NULL if free
+  uint32_t gen;                           // Code generation it was built in
+  struct swcase dflt;                     // The `default` label, if off > 0
+  struct swcase end;                      // The closing '}'
+  struct swcase cases[MJS_SWITCH_CASES];  // Case labels, a hash table
+};
+#endif
+
+#if MJS_SKIP_INDEX_SIZE > 0
+// Bracketed group of a source buffer: offsets of its opening and closing
+// brackets, and the number of lines in between
+struct group {
+  len_t open;   // Offset of the opening bracket
+  len_t close;  // Offset of the closing bracket
+  len_t lines;  // Newlines the lexer counts between the two
+};
+
+// Skip index of a source buffer: its groups in vm->groups, in the order of
+// their opening brackets. Built on the first skip, see group_index()
+struct grouptab {
+  const char *buf;  // Source buffer, NULL if free
+  uint32_t gen;     // Code generation the index was built in
+  ind_t first;      // First group in vm->groups
+  ind_t count;      // Number of groups, INVALID_INDEX if not indexed
+};
+#endif
+
+// Script compiled by mjs_compile(). Its code caches stay valid across runs
+struct script {
+  const char *buf;  // Source code, owned by the caller. NULL if slot is free
+  len_t len;        // Source code length
+#if MJS_SKIP_INDEX_SIZE > 0
+  struct grouptab index;  // Skip index, at the start of vm->groups
+#endif
+};
+
 struct vm {
   char error_message[MJS_ERROR_MESSAGE_SIZE];
-  val_t data_stack[MJS_DATA_STACK_SIZE];
-  val_t call_stack[MJS_CALL_STACK_SIZE];
+  struct mjs_config cfg;                  // Pool sizes
+  uint8_t *mem;                           // Memory allocated by mjs_create()
+  val_t *data_stack;                      // Data stack
+  val_t *call_stack;                      // Call stack
   ind_t sp;                               // Points to the top of the data stack
   ind_t csp;                              // Points to the top of the call stack
   ind_t stringbuf_len;                    // String pool current length
-  struct obj objs[MJS_OBJ_POOL_SIZE];     // Objects pool
-  struct prop props[MJS_PROP_POOL_SIZE];  // Props pool
-  struct cfunc cfuncs[MJS_CFUNC_POOL_SIZE];  // C functions pool
-  uint8_t stringbuf[MJS_STRING_POOL_SIZE];   // String pool
+  ind_t free_obj;                         // Free objects list head
+  ind_t free_prop;                        // Free props list head
+  ind_t cfuncs_len;                       // Number of C functions allocated
+  struct mjs_stats stats;                 // Usage statistics
+  struct obj *objs;                       // Objects pool
+  val_t *prop_keys;                       // Props pool: keys
+  val_t *prop_vals;                       // Props pool: values
+  ind_t *prop_next;                       // Props pool: next prop of an obj
+  uint8_t *prop_tags;                     // Props pool: key tags
+  struct cfunc *cfuncs;                   // C functions pool
+  struct script scripts[MJS_SCRIPT_POOL_SIZE];  // Compiled scripts
+  struct resume resume;                   // Suspended script
+  int budget;                             // Statements per slice, 0: no limit
+  int steps;                              // Statements run in this slice
+  uint8_t suspended;                      // Unwinding a suspended script
+  uint8_t nesting;                        // Number of scripts being run
+  uint32_t now;                           // Time of the last mjs_poll()
+  uint32_t (*clock)(void);                // Host clock, see mjs_set_clock()
+#if MJS_TRACE
+  struct mjs_trace_hdr *trace;            // Trace buffer, NULL if not set
+  uint16_t line;                          // Line of the current statement
+#endif
+#if MJS_HISTOGRAM_BUCKETS > 0
+  struct mjs_histogram hist[MJS_HIST_MAX];  // Latency histograms
+#endif
+#if MJS_PROFILE_SIZE > 0
+  struct prof prof[MJS_PROFILE_SIZE];     // Profile, a hash table
+  char prof_funcs[MJS_PROFILE_FUNCS][MJS_PROFILE_NAME_SIZE];  // Names
+  ind_t prof_frame;                       // Entry that called current func
+  ind_t prof_cur;                         // Entry of the current statement
+  uint8_t prof_func;                      // Current function
+  const char *callee;                     // Name of the function being called
+  int callee_len;                         // Length of that name
+  uint32_t prof_child;                    // Time of the nested statements
+  uint32_t prof_lost;                     // Statements that did not fit
+#endif
+#if MJS_TIMER_POOL_SIZE > 0
+  struct timer timers[MJS_TIMER_POOL_SIZE];  // Timers pool
+  ind_t wheel[MJS_TIMER_WHEEL_SIZE];         // Timer lists, one per tick
+  uint32_t ticks;                            // Last processed wheel tick
+  uint32_t tick_ms;                          // Host time that tick started
+#endif
+#if MJS_TASK_POOL_SIZE > 0
+  struct task tasks[MJS_TASK_POOL_SIZE];  // Tasks pool
+  ind_t task;                             // Running task + 1, 0 if none
+  uint8_t yield;                          // Running task wants to sleep
+#endif
+#if MJS_CODE_CACHES
+  uint32_t code_gen;                      // Bumped when function code moves
+  uint32_t run_gen;                       // Bumped when a script ends
+#endif
+#if MJS_SWITCH_CACHE_SIZE > 0
+  struct swtab switches[MJS_SWITCH_CACHE_SIZE];  // Switch case tables
+  uint8_t switch_next;                    // Table to be replaced next
+#endif
+#if MJS_SKIP_INDEX_SIZE > 0
+  struct grouptab grouptabs[MJS_SKIP_INDEX_BUFS];  // Skip indexes
+  struct group groups[MJS_SKIP_INDEX_SIZE];  // Groups of all the indexes
+  ind_t groups_len;                       // Number of groups taken
+  ind_t groups_pinned;                    // Groups of compiled scripts
+  uint8_t grouptab_next;                  // Index to be replaced next
+#endif
+  uint8_t *stringbuf;                        // String pool
 };
 
 #define ARRSIZE(x) ((sizeof(x) / sizeof((x)[0])))
@@ -206,37 +567,91 @@ struct vm {
     if (res == MJS_ERROR) return res; \
   } while (0)
 
+#if MJS_TRACE
+#define TRACE(vm, event, v) trace((vm), (event), (v))
+static void trace(struct vm *vm, int event, val_t v);
+#else
+#define TRACE(vm, event, v)
+#endif
+
 //////////////////////////////////// HELPERS /////////////////////////////////
 static val_t vm_err(struct vm *vm, const char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
   vsnprintf(vm->error_message, sizeof(vm->error_message), fmt, ap);
   va_end(ap);
+  TRACE(vm, MJS_TRACE_ERROR, MJS_ERROR);
   // LOG((DBGPREFIX "%s: %s\n", __func__, vm->error_message));
   return MJS_ERROR;
 }
 
 union mjs_type_holder {
   val_t v;
-  float f;
+  mjs_num_t f;
 };
 
 static mjs_type_t mjs_type(val_t v) {
   return IS_FLOAT(v) ? MJS_TYPE_NUMBER : VAL_TYPE(v);
 }
 
-static val_t tov(float f) {
+static val_t tov(mjs_num_t f) {
   union mjs_type_holder u;
   u.f = f;
   return u.v;
 }
 
-static float tof(val_t v) {
+static mjs_num_t tof(val_t v) {
   union mjs_type_holder u;
   u.v = v;
   return u.f;
 }
 
+#if MJS_HISTOGRAM_BUCKETS > 0
+static uint32_t hist_start(struct vm *vm) {
+  return vm->clock == NULL ? 0 : vm->clock();
+}
+
+// Account latency of an operation that began at `start`
+static void hist_add(struct vm *vm, int kind, uint32_t start) {
+  struct mjs_histogram *h = &vm->hist[kind];
+  uint32_t t;
+  int i = 0;
+  if (vm->clock == NULL) return;
+  t = vm->clock() - start;
+  while (i < MJS_HISTOGRAM_BUCKETS - 1 && (t >> i) != 0) i++;
+  h->buckets[i]++;
+  h->count++;
+  if (t > h->max) h->max = t;
+}
+#endif
+
+#if MJS_TRACE
+// Append an event to the trace ring, overwriting the oldest one
+static void trace(struct vm *vm, int event, val_t v) {
+  struct mjs_trace_hdr *h = vm->trace;
+  struct mjs_trace_event *e;
+  if (h == NULL) return;
+  e = (struct mjs_trace_event *) (h + 1) + h->head % h->size;
+  h->head++;
+  e->time = vm->clock == NULL ? 0 : vm->clock();
+  e->line = vm->line;
+  e->event = (uint8_t) event;
+  e->sp = (uint16_t) vm->sp;
+  e->csp = (uint16_t) vm->csp;
+  if (event == MJS_TRACE_OP) {
+    e->type = 0;
+    e->payload = (uint32_t) v;
+  } else if (IS_FLOAT(v)) {
+    float f = (float) tof(v);
+    e->type = MJS_TYPE_NUMBER;
+    memcpy(&e->payload, &f, sizeof(e->payload));
+  } else {
+    e->type = (uint8_t) VAL_TYPE(v);
+    e->payload = (uint32_t) VAL_PAYLOAD(v);
+  }
+}
+#endif
+
 static const char *mjs_typeof(val_t v) {
   const char *names[] = {"undefined", "null",   "true",   "false",
                          "string",    "object", "object", "function",
@@ -245,14 +660,14 @@ static const char *mjs_typeof(val_t v) {
   return names[mjs_type(v)];
 }
 
-static struct prop *firstprop(struct vm *vm, val_t obj);
+static ind_t firstprop(struct vm *vm, val_t obj);
 const char *tostr(struct vm *vm, val_t v) {
   static char buf[64];
   mjs_type_t t = mjs_type(v);
   switch (t) {
     case MJS_TYPE_NUMBER: {
       double f = tof(v), iv;
-      if (modf(f, &iv) == 0) {
+      if (modf(f, &iv) == 0 && fabs(f) < 1e15) {
         snprintf(buf, sizeof(buf), "%ld", (long) f);
       } else {
         snprintf(buf, sizeof(buf), "%g", f);
@@ -270,17 +685,21 @@ const char *tostr(struct vm *vm, val_t v) {
       snprintf(buf, sizeof(buf), "cfunc@%p", vm->cfuncs[VAL_PAYLOAD(v)].fn);
       break;
     case MJS_TYPE_ERROR:
+      if (v == MJS_SUSPENDED) {
+        snprintf(buf, sizeof(buf), "suspended");
+        break;
+      }
       snprintf(buf, sizeof(buf), "ERROR: %s", vm->error_message);
       break;
     case MJS_TYPE_OBJECT: {
       int n = snprintf(buf, sizeof(buf), "obj(");
-      struct prop *prop = firstprop(vm, v);
-      while (prop != NULL) {
-        char *key = mjs_to_str(vm, prop->key, NULL);
+      ind_t i;
+      for (i = firstprop(vm, v); i != INVALID_INDEX; i = vm->prop_next[i]) {
+        char *key = mjs_to_str(vm, vm->prop_keys[i], NULL);
+        if (n >= (int) sizeof(buf) - 1) break;  // Truncated
         n += snprintf(buf + n, sizeof(buf) - n, "%s%s", n > 4 ? "," : "", key);
-        prop = prop->next == INVALID_INDEX ? NULL : &vm->props[prop->next];
       }
-      n += snprintf(buf + n, sizeof(buf) - n, ")");
+      if (n < (int) sizeof(buf) - 1) snprintf(buf + n, sizeof(buf) - n, ")");
       break;
     }
     default:
@@ -294,22 +713,22 @@ const char *tostr(struct vm *vm, val_t v) {
 static void vm_dump(const struct vm *vm) {
   ind_t i;
   printf("[VM] %8s: ", "objs");
-  for (i = 0; i < ARRSIZE(vm->objs); i++) {
+  for (i = 0; i < vm->cfg.obj_pool_size; i++) {
     putchar(vm->objs[i].flags ? 'v' : '-');
   }
   putchar('\n');
   printf("[VM] %8s: ", "props");
-  for (i = 0; i < ARRSIZE(vm->props); i++) {
-    putchar(vm->props[i].flags ? 'v' : '-');
+  for (i = 0; i < vm->cfg.prop_pool_size; i++) {
+    putchar(vm->prop_tags[i] ? 'v' : '-');
   }
   putchar('\n');
   printf("[VM] %8s: ", "cfuncs");
-  for (i = 0; i < ARRSIZE(vm->cfuncs); i++) {
+  for (i = 0; i < vm->cfg.cfunc_pool_size; i++) {
     putchar(vm->cfuncs[i].fn ? 'v' : '-');
   }
   putchar('\n');
   printf("[VM] %8s: %d/%d\n", "strings", vm->stringbuf_len,
-         (int) sizeof(vm->stringbuf));
+         vm->cfg.string_pool_size);
   printf("[VM]  sp %d, csp %d, sb %d\n", vm->sp, vm->csp, vm->stringbuf_len);
 }
 #else
@@ -319,18 +738,45 @@ static void vm_dump(const struct vm *vm) {
 ////////////////////////////////////// VM ////////////////////////////////////
 static val_t *vm_top(struct vm *vm) { return &vm->data_stack[vm->sp - 1]; }
 
+// If `v` is a string or function stored after the deallocated string at
+// offset `i` of `len` bytes, return the value pointing to its new location
+static val_t relocate(val_t v, ind_t i, ind_t len) {
+  mjs_type_t t = mjs_type(v);
+  if ((t == MJS_TYPE_STRING || t == MJS_TYPE_FUNCTION) && VAL_PAYLOAD(v) > i) {
+    v = MK_VAL(t, VAL_PAYLOAD(v) - len);
+  }
+  return v;
+}
+
+// Free entries of the objects and props pools are threaded into lists
+// through their `props` and `next` fields, giving O(1) alloc and free
+static void free_obj(struct vm *vm, ind_t i) {
+  vm->objs[i].flags = 0;
+  vm->objs[i].props = vm->free_obj;
+  vm->free_obj = i;
+}
+
+static void free_prop(struct vm *vm, ind_t i) {
+  vm->prop_tags[i] = 0;
+  vm->prop_next[i] = vm->free_prop;
+  vm->free_prop = i;
+}
+
 static void abandon(struct vm *vm, val_t v) {
   mjs_type_t t = mjs_type(v);
   LOG((DBGPREFIX "%s: %s\n", __func__, tostr(vm, v)));
 
   if (t != MJS_TYPE_OBJECT && t != MJS_TYPE_STRING) return;
+  vm->stats.abandons++;
   {
     ind_t j;
-    // If this value is still referenced, do nothing
-    for (j = 0; j < ARRSIZE(vm->props); j++) {
-      struct prop *prop = &vm->props[j];
-      if (prop->flags == 0) continue;
-      if (v == prop->key || v == prop->val) return;
+    // If this value is still referenced, do nothing. Keys are strings, so
+    // for objects only the values array is scanned
+    for (j = 0; j < vm->cfg.prop_pool_size; j++) {
+      if (v == vm->prop_vals[j] && vm->prop_tags[j] != 0) return;
+    }
+    for (j = 0; t == MJS_TYPE_STRING && j < vm->cfg.prop_pool_size; j++) {
+      if (v == vm->prop_keys[j] && vm->prop_tags[j] != 0) return;
     }
     // Look at the data stack too
     for (j = 0; j < vm->sp; j++)
@@ -341,55 +787,69 @@ static void abandon(struct vm *vm, val_t v) {
   if (t == MJS_TYPE_OBJECT) {
     ind_t i, obj_index = (ind_t) VAL_PAYLOAD(v);
     struct obj *o = &vm->objs[obj_index];
-    o->flags = 0;  // Mark object free
+    if (o->flags == 0) return;  // Already free
     i = o->props;
+    free_obj(vm, obj_index);
+    vm->stats.objs--;
     while (i != INVALID_INDEX) {  // Deallocate obj's properties too
-      struct prop *prop = &vm->props[i];
-      prop->flags = 0;  // Mark property free
-      assert(mjs_type(prop->key) == MJS_TYPE_STRING);
-      abandon(vm, prop->key);
-      abandon(vm, prop->val);
-      i = prop->next;  // Point to the next property
+      ind_t next = vm->prop_next[i];
+      free_prop(vm, i);
+      vm->stats.props--;
+      assert(mjs_type(vm->prop_keys[i]) == MJS_TYPE_STRING);
+      abandon(vm, vm->prop_keys[i]);
+      abandon(vm, vm->prop_vals[i]);
+      i = next;  // Point to the next property
     }
   } else if (t == MJS_TYPE_STRING) {
-    ind_t k, j, i = (ind_t) VAL_PAYLOAD(v);     // String begin
+    ind_t j, i = (ind_t) VAL_PAYLOAD(v);        // String begin
     ind_t len = (ind_t)(vm->stringbuf[i] + 2);  // String length
 
     // printf("abandoning %d %d [%s]\n", (int) i, (int) len, tostr(vm, v));
     // Ok, not referenced, deallocate a string
-    if (i + len == sizeof(vm->stringbuf) || i + len == vm->stringbuf_len) {
+    if (i + len == vm->stringbuf_len) {
       // printf("shrink [%s]\n", tostr(vm, v));
       vm->stringbuf[i] = 0;   // If we're the last string,
       vm->stringbuf_len = i;  // shrink the buf immediately
     } else {
-      vm->stringbuf[i + len - 1] = 'x';  // Mark string as dead
-      // Relocate all live strings to the beginning of the buffer
+      // Relocate all following strings to close the gap
       // printf("--> RELOC, %hu %hu\n", vm->stringbuf_len, len);
-      memmove(&vm->stringbuf[i], &vm->stringbuf[i + len], len);
-      assert(vm->stringbuf_len >= len);
+      assert(vm->stringbuf_len >= i + len);
+      memmove(&vm->stringbuf[i], &vm->stringbuf[i + len],
+              vm->stringbuf_len - (i + len));
       vm->stringbuf_len = (ind_t)(vm->stringbuf_len - len);
-      for (j = 0; j < ARRSIZE(vm->props); j++) {
-        struct prop *prop = &vm->props[j];
-        if (prop->flags != 0) continue;
-        k = (ind_t) VAL_PAYLOAD(prop->key);
-        if (k > i) prop->key = MK_VAL(MJS_TYPE_STRING, k - len);
-        if (mjs_type(prop->val) == MJS_TYPE_STRING) {
-          k = (ind_t) VAL_PAYLOAD(prop->val);
-          if (k > i) prop->key = MK_VAL(MJS_TYPE_STRING, k - len);
-        }
+      vm->stats.compactions++;
+#if MJS_CODE_CACHES
+      vm->code_gen++;  // Function code may have moved
+#endif
+      // Relocate free props too: a prop being freed by the caller, see the
+      // object case above, may still hold strings to be abandoned
+      for (j = 0; j < vm->cfg.prop_pool_size; j++) {
+        vm->prop_keys[j] = relocate(vm->prop_keys[j], i, len);
+        vm->prop_vals[j] = relocate(vm->prop_vals[j], i, len);
       }
+      for (j = 0; j < vm->sp; j++) {
+        vm->data_stack[j] = relocate(vm->data_stack[j], i, len);
+      }
+#if MJS_TIMER_POOL_SIZE > 0
+      for (j = 0; j < ARRSIZE(vm->timers); j++) {
+        vm->timers[j].fn = relocate(vm->timers[j].fn, i, len);
+      }
+#endif
     }
     // printf("sbuflen %d\n", (int) vm->stringbuf_len);
   }
 }
 
 static val_t vm_push(struct vm *vm, val_t v) {
-  if (vm->sp < ARRSIZE(vm->data_stack)) {
+  if (vm->sp < vm->cfg.data_stack_size) {
     LOG((DBGPREFIX "%s: %s\n", __func__, tostr(vm, v)));
     vm->data_stack[vm->sp] = v;
     vm->sp++;
+    TRACE(vm, MJS_TRACE_PUSH, v);
+    if (vm->sp > vm->stats.stack_peak) vm->stats.stack_peak = vm->sp;
     return MJS_TRUE;
   } else {
+    vm->stats.ooms++;
     return vm_err(vm, "stack overflow");
   }
 }
@@ -398,6 +858,7 @@ static val_t vm_drop(struct vm *vm) {
   if (vm->sp > 0) {
     LOG((DBGPREFIX "%s: %s\n", __func__, tostr(vm, *vm_top(vm))));
     vm->sp--;
+    TRACE(vm, MJS_TRACE_DROP, vm->data_stack[vm->sp]);
     abandon(vm, vm->data_stack[vm->sp]);
     return MJS_TRUE;
   } else {
@@ -410,7 +871,9 @@ static val_t mk_str(struct vm *vm, const char *p, int n) {
   // printf("%s [%.*s], %d\n", __func__, n, p, (int) vm->stringbuf_len);
   if (len > 0xff) {
     return vm_err(vm, "string is too long");
-  } else if (len + 2 > sizeof(vm->stringbuf) - vm->stringbuf_len) {
+  } else if ((size_t) len + 2 >
+             (size_t)(vm->cfg.string_pool_size - vm->stringbuf_len)) {
+    vm->stats.ooms++;
     return vm_err(vm, "string OOM");
   } else {
     val_t v = MK_VAL(MJS_TYPE_STRING, vm->stringbuf_len);
@@ -418,6 +881,10 @@ static val_t mk_str(struct vm *vm, const char *p, int n) {
     if (p) memmove(&vm->stringbuf[vm->stringbuf_len], p, len);   // copy data
     vm->stringbuf_len = (ind_t)(vm->stringbuf_len + len);
     vm->stringbuf[vm->stringbuf_len++] = 0;  // nul-terminate
+    if (vm->stringbuf_len > vm->stats.strings_peak) {
+      vm->stats.strings_peak = vm->stringbuf_len;
+    }
+    vm->stats.allocs++;
     return v;
   }
 }
@@ -440,50 +907,56 @@ static val_t mjs_concat(struct vm *vm, val_t v1, val_t v2) {
   return v;
 }
 
+// C functions are never freed, so they're allocated one after another
 static val_t mk_cfunc(struct vm *vm) {
-  ind_t i;
-  for (i = 0; i < ARRSIZE(vm->cfuncs); i++) {
-    if (vm->cfuncs[i].fn != NULL) continue;
-    return MK_VAL(MJS_TYPE_C_FUNCTION, i);
+  if (vm->cfuncs_len >= vm->cfg.cfunc_pool_size) {
+    vm->stats.ooms++;
+    return vm_err(vm, "cfunc OOM");
   }
-  return vm_err(vm, "cfunc OOM");
+  return MK_VAL(MJS_TYPE_C_FUNCTION, vm->cfuncs_len);
 }
 
 static val_t mk_obj(struct vm *vm) {
-  ind_t i;
-  // Start iterating from 1, because object 0 is always a global object
-  for (i = 1; i < ARRSIZE(vm->objs); i++) {
-    if (vm->objs[i].flags != 0) continue;
-    vm->objs[i].flags = OBJ_ALLOCATED;
-    vm->objs[i].props = INVALID_INDEX;
-    return MK_VAL(MJS_TYPE_OBJECT, i);
+  ind_t i = vm->free_obj;
+  if (i == INVALID_INDEX) {
+    vm->stats.ooms++;
+    return vm_err(vm, "obj OOM");
   }
-  return vm_err(vm, "obj OOM");
+  vm->free_obj = vm->objs[i].props;
+  vm->objs[i].flags = OBJ_ALLOCATED;
+  vm->objs[i].props = INVALID_INDEX;
+  if (++vm->stats.objs > vm->stats.objs_peak) {
+    vm->stats.objs_peak = vm->stats.objs;
+  }
+  vm->stats.allocs++;
+  return MK_VAL(MJS_TYPE_OBJECT, i);
 }
 
 static val_t mk_func(struct vm *vm, const char *code, int len) {
   val_t v = mk_str(vm, code, len);
   if (v != MJS_ERROR) {
-    v &= ~((val_t) 0x0f << 19);
-    v |= (val_t) MJS_TYPE_FUNCTION << 19;
+    v &= ~((val_t) 0x0f << VAL_SHIFT);
+    v |= (val_t) MJS_TYPE_FUNCTION << VAL_SHIFT;
   }
   return v;
 }
 
 static val_t create_scope(struct vm *vm) {
   val_t scope;
-  if (vm->csp >= ARRSIZE(vm->call_stack) - 1) {
+  if (vm->csp >= vm->cfg.call_stack_size - 1) {
+    vm->stats.ooms++;
     return vm_err(vm, "Call stack OOM");
   }
   if ((scope = mk_obj(vm)) == MJS_ERROR) return MJS_ERROR;
   LOG((DBGPREFIX "%s\n", __func__));
   vm->call_stack[vm->csp] = scope;
   vm->csp++;
+  if (vm->csp > vm->stats.call_stack_peak) vm->stats.call_stack_peak = vm->csp;
   return scope;
 }
 
 static val_t delete_scope(struct vm *vm) {
-  if (vm->csp <= 0 || vm->csp >= ARRSIZE(vm->call_stack)) {
+  if (vm->csp <= 0 || vm->csp >= vm->cfg.call_stack_size) {
     return vm_err(vm, "Corrupt call stack");
   } else {
     LOG((DBGPREFIX "%s\n", __func__));
@@ -493,21 +966,30 @@ static val_t delete_scope(struct vm *vm) {
   }
 }
 
-static struct prop *firstprop(struct vm *vm, val_t obj) {
+static ind_t firstprop(struct vm *vm, val_t obj) {
   ind_t obj_index = (ind_t) VAL_PAYLOAD(obj);
-  struct obj *o = &vm->objs[obj_index];
-  if (obj_index >= ARRSIZE(vm->objs)) return NULL;
-  return o->props == INVALID_INDEX ? NULL : &vm->props[o->props];
+  if (obj_index >= vm->cfg.obj_pool_size) return INVALID_INDEX;
+  return vm->objs[obj_index].props;
+}
+
+static uint8_t prop_tag(const char *ptr, len_t len) {
+  uint8_t h = (uint8_t) len;
+  while (len-- > 0) h = (uint8_t)(h * 31 + (uint8_t) *ptr++);
+  return (uint8_t)(h | PROP_ALLOCATED);
 }
 
 // Lookup property in a given object
 static val_t *findprop(struct vm *vm, val_t obj, const char *ptr, len_t len) {
-  struct prop *prop = firstprop(vm, obj);
-  while (prop != NULL) {
+  uint8_t tag = prop_tag(ptr, len);
+  ind_t i;
+  vm->stats.lookups++;
+  for (i = firstprop(vm, obj); i != INVALID_INDEX; i = vm->prop_next[i]) {
     len_t n = 0;
-    char *key = mjs_to_str(vm, prop->key, &n);
-    if (n == len && memcmp(key, ptr, n) == 0) return &prop->val;
-    prop = prop->next == INVALID_INDEX ? NULL : &vm->props[prop->next];
+    char *key;
+    vm->stats.lookup_steps++;
+    if (vm->prop_tags[i] != tag) continue;
+    key = mjs_to_str(vm, vm->prop_keys[i], &n);
+    if (n == len && memcmp(key, ptr, n) == 0) return &vm->prop_vals[i];
   }
   return NULL;
 }
@@ -543,21 +1025,25 @@ static val_t mjs_set(struct vm *vm, val_t obj, val_t key, val_t val) {
     } else {
       ind_t i, obj_index = (ind_t) VAL_PAYLOAD(obj);
       struct obj *o = &vm->objs[obj_index];
-      if (obj_index >= ARRSIZE(vm->objs)) {
+      if (obj_index >= vm->cfg.obj_pool_size) {
         return vm_err(vm, "corrupt obj, index %x", obj_index);
       }
-      for (i = 0; i < ARRSIZE(vm->props); i++) {
-        struct prop *p = &vm->props[i];
-        if (p->flags != 0) continue;
-        p->flags = PROP_ALLOCATED;
-        p->next = o->props;  // Link to the current
-        o->props = i;        // props list
-        p->key = key;
-        p->val = val;
+      if ((i = vm->free_prop) != INVALID_INDEX) {
+        vm->free_prop = vm->prop_next[i];
+        vm->prop_tags[i] = prop_tag(ptr, len);
+        vm->prop_next[i] = o->props;  // Link to the current
+        o->props = i;                 // props list
+        vm->prop_keys[i] = key;
+        vm->prop_vals[i] = val;
+        if (++vm->stats.props > vm->stats.props_peak) {
+          vm->stats.props_peak = vm->stats.props;
+        }
+        vm->stats.allocs++;
         LOG((DBGPREFIX "%s: prop %hu %s -> ", __func__, i, tostr(vm, key)));
         LOG(("%s\n", tostr(vm, val)));
         return MJS_TRUE;
       }
+      vm->stats.ooms++;
       return vm_err(vm, "props OOM");
     }
   } else {
@@ -578,7 +1064,7 @@ static int is_true(struct vm *vm, val_t v) {
 struct tok {
   tok_t tok, len;
   const char *ptr;
-  float num_value;
+  mjs_num_t num_value;
 };
 
 struct parser {
@@ -589,10 +1075,33 @@ struct parser {
   int line_no;            // Line number
   tok_t prev_tok;         // Previous token, for prefix increment / decrement
   struct tok tok;         // Parsed token
+  struct tok ahead;       // Next token, if peeked by lookahead()
+  const char *ahead_pos;  // Position after the peeked token, or NULL
+  int ahead_line;         // Line number after the peeked token
   int noexec;             // Parse only, do not execute
+  int depth;              // Number of statements being parsed
+  int loops;              // Number of loops being run
+  int switches;           // Number of switch statements being run
+  int flow;               // Pending break, continue or return, see below
+  int seek;               // Resuming: skip to the saved statement
+  int compile;            // Parsing for mjs_compile(), see parse_switch()
+  struct resume *rs;      // Non-NULL if this script can be suspended
   struct vm *vm;
 };
 
+// A break, continue or return makes the enclosing statements stop and
+// return, until the loop or function it belongs to takes it
+enum { FLOW_NONE, FLOW_BREAK, FLOW_CONTINUE, FLOW_RETURN };
+
+// Parser checkpoint: enough to get back to a location without re-lexing
+// the current token or copying the whole parser
+struct mark {
+  const char *pos;  // Position after the current token
+  int line_no;      // Line number
+  tok_t prev_tok;   // Previous token
+  struct tok tok;   // Current token
+};
+
 #define DT(a, b) ((tok_t)(a) << 8 | (b))
 #define TT(a, b, c) ((tok_t)(a) << 16 | (tok_t)(b) << 8 | (c))
 #define QT(a, b, c, d) \
@@ -668,9 +1177,10 @@ static int longtok4(struct parser *p, char a, char b, char c, char d) {
 static int getnum(struct parser *p) {
   if (p->pos[0] == '0' && p->pos[1] == 'x') {
     // MSVC6 strtod cannot parse 0x... numbers, thus this ugly workaround.
-    p->tok.num_value = (float) strtoul(p->pos + 2, (char **) &p->pos, 16);
+    p->tok.num_value =
+        (mjs_num_t) strtoul(p->pos + 2, (char **) &p->pos, 16);
   } else {
-    p->tok.num_value = (float) strtod(p->pos, (char **) &p->pos);
+    p->tok.num_value = (mjs_num_t) strtod(p->pos, (char **) &p->pos);
   }
   p->tok.len = p->pos - p->tok.ptr;
   p->pos--;
@@ -744,6 +1254,14 @@ static void skip_spaces_and_comments(struct parser *p) {
 static tok_t pnext(struct parser *p) {
   tok_t tmp, tok = TOK_INVALID;
 
+  if (p->ahead_pos != NULL) {  // Already lexed by lookahead()
+    p->prev_tok = p->tok.tok;
+    p->tok = p->ahead;
+    p->pos = p->ahead_pos;
+    p->line_no = p->ahead_line;
+    p->ahead_pos = NULL;
+    return p->tok.tok;
+  }
   skip_spaces_and_comments(p);
   p->tok.ptr = p->pos;
   p->tok.len = 1;
@@ -790,6 +1308,7 @@ static tok_t pnext(struct parser *p) {
 
 static val_t parse_statement_list(struct parser *p, tok_t endtok);
 static val_t parse_expr(struct parser *p);
+static val_t parse_binary(struct parser *p, int min_prec);
 static val_t parse_statement(struct parser *p);
 
 #define EXPECT(p, t)                                               \
@@ -818,9 +1337,6 @@ static tok_t s_assign_ops[] = {
 static tok_t s_postfix_ops[] = {DT('+', '+'), DT('-', '-'), TOK_EOF};
 static tok_t s_unary_ops[] = {'!',        '~', DT('+', '+'), DT('-', '-'),
                               TOK_TYPEOF, '-', '+',          TOK_EOF};
-static tok_t s_equality_ops[] = {DT('=', '+'), DT('!', '='), TT('=', '=', '='),
-                                 TT('=', '=', '='), TOK_EOF};
-static tok_t s_cmp_ops[] = {DT('<', '='), '<', '>', DT('>', '='), TOK_EOF};
 
 static tok_t findtok(const tok_t *toks, tok_t tok) {
   int i = 0;
@@ -828,39 +1344,110 @@ static tok_t findtok(const tok_t *toks, tok_t tok) {
   return toks[i];
 }
 
-static float do_arith_op(float f1, float f2, val_t op) {
+static mjs_num_t do_arith_op(mjs_num_t f1, mjs_num_t f2, val_t op) {
   // clang-format off
   switch (op) {
     case '+': return f1 + f2;
     case '-': return f1 - f2;
     case '*': return f1 * f2;
     case '/': return f1 / f2;
-    case '%': return (float) ((long) f1 % (long) f2);
-    case '^': return (float) ((val_t) f1 ^ (val_t) f2);
-    case '|': return (float) ((val_t) f1 | (val_t) f2);
-    case '&': return (float) ((val_t) f1 & (val_t) f2);
-    case DT('>','>'): return (float) ((long) f1 >> (long) f2);
-    case DT('<','<'): return (float) ((long) f1 << (long) f2);
-    case TT('>','>', '>'): return (float) ((val_t) f1 >> (val_t) f2);
+    case '%': return (mjs_num_t) ((long) f1 % (long) f2);
+    case '^': return (mjs_num_t) ((uint32_t) f1 ^ (uint32_t) f2);
+    case '|': return (mjs_num_t) ((uint32_t) f1 | (uint32_t) f2);
+    case '&': return (mjs_num_t) ((uint32_t) f1 & (uint32_t) f2);
+    case DT('>','>'): return (mjs_num_t) ((long) f1 >> (long) f2);
+    case DT('<','<'): return (mjs_num_t) ((long) f1 << (long) f2);
+    case TT('>','>', '>'): return (mjs_num_t) ((uint32_t) f1 >> (uint32_t) f2);
   }
   // clang-format on
   return 0;
 }
 
+// Compare strings, shorter ones first if one is a prefix of the other
+static int str_cmp(struct vm *vm, val_t a, val_t b) {
+  len_t n1, n2;
+  const char *s1 = mjs_to_str(vm, a, &n1), *s2 = mjs_to_str(vm, b, &n2);
+  int r = memcmp(s1, s2, n1 < n2 ? n1 : n2);
+  return r != 0 ? r : n1 < n2 ? -1 : n1 > n2 ? 1 : 0;
+}
+
+static int is_strict_equal(struct vm *vm, val_t a, val_t b) {
+  mjs_type_t t = mjs_type(a);
+  len_t n1, n2;
+  const char *s1, *s2;
+  if (t == MJS_TYPE_NUMBER && mjs_type(b) == MJS_TYPE_NUMBER) {
+    return tof(a) == tof(b);  // Not bitwise, as NaN !== NaN
+  }
+  if (a == b) return 1;  // Same object, same string, or same simple value
+  if (t != MJS_TYPE_STRING || mjs_type(b) != MJS_TYPE_STRING) return 0;
+  // Different strings in the pool may still hold the same bytes
+  s1 = mjs_to_str(vm, a, &n1);
+  s2 = mjs_to_str(vm, b, &n2);
+  return n1 == n2 && memcmp(s1, s2, n1) == 0;
+}
+
+// Replace two values on top of the stack with a boolean
+static val_t set_bool(struct vm *vm, int cond) {
+  val_t *t = vm_top(vm), a = t[-1];
+  t[-1] = cond ? MJS_TRUE : MJS_FALSE;
+  abandon(vm, a);
+  return vm_drop(vm);
+}
+
+static val_t do_cmp_op(struct vm *vm, tok_t op) {
+  val_t *t = vm_top(vm), a = t[-1], b = t[0];
+  int r;
+  if (mjs_type(a) == MJS_TYPE_NUMBER && mjs_type(b) == MJS_TYPE_NUMBER) {
+    mjs_num_t f1 = tof(a), f2 = tof(b);
+    // clang-format off
+    switch (op) {
+      case '<':         return set_bool(vm, f1 < f2);
+      case '>':         return set_bool(vm, f1 > f2);
+      case DT('<', '='): return set_bool(vm, f1 <= f2);
+      default:          return set_bool(vm, f1 >= f2);
+    }
+    // clang-format on
+  }
+  if (mjs_type(a) != MJS_TYPE_STRING || mjs_type(b) != MJS_TYPE_STRING) {
+    return vm_err(vm, "apples to apples please");
+  }
+  r = a == b ? 0 : str_cmp(vm, a, b);
+  // clang-format off
+  switch (op) {
+    case '<':         return set_bool(vm, r < 0);
+    case '>':         return set_bool(vm, r > 0);
+    case DT('<', '='): return set_bool(vm, r <= 0);
+    default:          return set_bool(vm, r >= 0);
+  }
+  // clang-format on
+}
+
+// Property value that a reference pushed by the parser points to, or NULL
+// if `v` is not a reference to a live property
+static val_t *lvalue(struct vm *vm, val_t v) {
+  ind_t ind;
+  if (mjs_type(v) != MJS_TYPE_REF) return NULL;
+  ind = (ind_t) VAL_PAYLOAD(v);
+  if (ind >= vm->cfg.prop_pool_size || vm->prop_tags[ind] == 0) return NULL;
+  return &vm->prop_vals[ind];
+}
+
 static val_t do_assign_op(struct vm *vm, tok_t op) {
   val_t *t = vm_top(vm);
-  struct prop *prop = &vm->props[(ind_t) tof(t[-1])];
-  if (mjs_type(prop->val) != MJS_TYPE_NUMBER ||
-      mjs_type(t[0]) != MJS_TYPE_NUMBER)
+  val_t *pv = lvalue(vm, t[-1]);
+  if (pv == NULL) return vm_err(vm, "bad lvalue");
+  if (mjs_type(*pv) != MJS_TYPE_NUMBER || mjs_type(t[0]) != MJS_TYPE_NUMBER)
     return vm_err(vm, "please no");
-  t[-1] = prop->val = tov(do_arith_op(tof(prop->val), tof(t[0]), op));
+  t[-1] = *pv = tov(do_arith_op(tof(*pv), tof(t[0]), op));
   vm_drop(vm);
-  return prop->val;
+  return *pv;
 }
 
 static val_t do_op(struct parser *p, int op) {
-  val_t *top = vm_top(p->vm), a = top[-1], b = top[0];
+  val_t *top, a, b;
   if (p->noexec) return MJS_TRUE;
+  top = vm_top(p->vm), a = top[-1], b = top[0];
+  TRACE(p->vm, MJS_TRACE_OP, (val_t) op);
   LOG((DBGPREFIX "%s: sp %d op %c %d\n", __func__, p->vm->sp, op, op));
   LOG((DBGPREFIX "    top-1 %s\n", tostr(p->vm, b)));
   LOG((DBGPREFIX "    top-2 %s\n", tostr(p->vm, a)));
@@ -873,6 +1460,7 @@ static val_t do_op(struct parser *p, int op) {
         vm_drop(p->vm);
         break;
       }
+      // Fall through
     // clang-format off
     case '-': case '*': case '/': case '%': case '^': case '&': case '|':
     case DT('>', '>'): case DT('<', '<'): case TT('>', '>', '>'):
@@ -897,14 +1485,19 @@ static val_t do_op(struct parser *p, int op) {
     case TT('>', '>', '='): return do_assign_op(p->vm, DT('>', '>'));
     case QT('>', '>', '>', '='):  return do_assign_op(p->vm, TT('>', '>', '>'));
     case ',': break;
+    case '<': case '>': case DT('<', '='): case DT('>', '='):
+      return do_cmp_op(p->vm, op);
+    case TT('=', '=', '='): case TT('!', '=', '='):
     /* clang-format on */
+      return set_bool(p->vm, is_strict_equal(p->vm, a, b) ==
+                                 (op == TT('=', '=', '=')));
     case TOK_POSTFIX_MINUS:
     case TOK_POSTFIX_PLUS: {
-      struct prop *prop = &p->vm->props[(ind_t) tof(b)];
-      if (mjs_type(prop->val) != MJS_TYPE_NUMBER)
-        return vm_err(p->vm, "please no");
-      top[0] = prop->val;
-      prop->val = tov(tof(prop->val) + ((op == TOK_POSTFIX_PLUS) ? 1 : -1));
+      val_t *pv = lvalue(p->vm, b);
+      if (pv == NULL) return vm_err(p->vm, "bad lvalue");
+      if (mjs_type(*pv) != MJS_TYPE_NUMBER) return vm_err(p->vm, "please no");
+      top[0] = *pv;
+      *pv = tov(tof(*pv) + ((op == TOK_POSTFIX_PLUS) ? 1 : -1));
       break;
     }
     case '!':
@@ -912,22 +1505,38 @@ static val_t do_op(struct parser *p, int op) {
       break;
     case '~':
       if (mjs_type(top[0]) != MJS_TYPE_NUMBER) return vm_err(p->vm, "noo");
-      top[0] = tov((float) (~(long) tof(top[0])));
+      top[0] = tov((mjs_num_t) (~(long) tof(top[0])));
       break;
     case TOK_UNARY_PLUS:
       break;
     case TOK_UNARY_MINUS:
       top[0] = tov(-tof(top[0]));
       break;
-      // static tok_t s_unary_ops[] = {'!',        '~', DT('+', '+'), DT('-',
-      // '-'),
-      //                              TOK_TYPEOF, '-', '+',          TOK_EOF};
+    case DT('+', '+'):
+    case DT('-', '-'): {
+      val_t *pv = lvalue(p->vm, b);
+      if (pv == NULL) return vm_err(p->vm, "bad lvalue");
+      if (mjs_type(*pv) != MJS_TYPE_NUMBER) return vm_err(p->vm, "please no");
+      *pv = tov(tof(*pv) + (op == DT('+', '+') ? 1 : -1));
+      top[0] = *pv;
+      break;
+    }
+    case TOK_TYPEOF: {
+      mjs_type_t t = mjs_type(b);
+      const char *name = t == MJS_TYPE_TRUE || t == MJS_TYPE_FALSE ? "boolean"
+                         : t == MJS_TYPE_C_FUNCTION ? "function"
+                                                    : mjs_typeof(b);
+      val_t v = mk_str(p->vm, name, (int) strlen(name));
+      if (v == MJS_ERROR) return v;
+      top[0] = v;
+      abandon(p->vm, b);
+      break;
+    }
     case '=': {
-      val_t obj = p->vm->call_stack[p->vm->csp - 1];
-      val_t res = mjs_set(p->vm, obj, a, b);
-      top[0] = a;
-      top[-1] = b;
-      if (res == MJS_ERROR) return res;
+      // Left side is a reference to a property that holds the variable
+      val_t *pv = lvalue(p->vm, a);
+      if (pv == NULL) return vm_err(p->vm, "bad lvalue");
+      *pv = top[-1] = b;
       return vm_drop(p->vm);
     }
     default:
@@ -936,47 +1545,322 @@ static val_t do_op(struct parser *p, int op) {
   return MJS_TRUE;
 }
 
-typedef val_t bpf_t(struct parser *p, int prev_op);
+// Precedence of binary operators, higher binds tighter. Assignments are
+// right-associative, all others are left-associative
+enum {
+  PREC_NONE, PREC_ASSIGN, PREC_TERNARY, PREC_OR, PREC_AND, PREC_BIT_OR,
+  PREC_BIT_XOR, PREC_BIT_AND, PREC_EQUALITY, PREC_COMPARISON, PREC_SHIFT,
+  PREC_ADDITIVE, PREC_MULTIPLICATIVE
+};
 
-static val_t parse_ltr_binop(struct parser *p, bpf_t f1, bpf_t f2,
-                             const tok_t *ops, tok_t prev_op) {
-  val_t res = MJS_TRUE;
-  TRY(f1(p, TOK_EOF));
-  if (prev_op != TOK_EOF) TRY(do_op(p, prev_op));
-  if (findtok(ops, p->tok.tok) != TOK_EOF) {
-    int op = p->tok.tok;
-    pnext(p);
-    TRY(f2(p, op));
+// The operator table of the expression parser, PREC_NONE if `tok` is not
+// a binary operator
+static int binop_prec(tok_t tok) {
+  // clang-format off
+  switch (tok) {
+    case '=': case DT('+', '='): case DT('-', '='): case DT('*', '='):
+    case DT('/', '='): case DT('%', '='): case TT('<', '<', '='):
+    case TT('>', '>', '='): case QT('>', '>', '>', '='): case DT('&', '='):
+    case DT('^', '='): case DT('|', '='):         return PREC_ASSIGN;
+    case '?':                                     return PREC_TERNARY;
+    case DT('|', '|'):                            return PREC_OR;
+    case DT('&', '&'):                            return PREC_AND;
+    case '|':                                     return PREC_BIT_OR;
+    case '^':                                     return PREC_BIT_XOR;
+    case '&':                                     return PREC_BIT_AND;
+    case DT('=', '='): case DT('!', '='):
+    case TT('=', '=', '='): case TT('!', '=', '='): return PREC_EQUALITY;
+    case '<': case '>': case DT('<', '='): case DT('>', '='):
+                                                  return PREC_COMPARISON;
+    case DT('<', '<'): case DT('>', '>'): case TT('>', '>', '>'):
+                                                  return PREC_SHIFT;
+    case '+': case '-':                           return PREC_ADDITIVE;
+    case '*': case '/': case '%':                 return PREC_MULTIPLICATIVE;
+    default:                                      return PREC_NONE;
   }
-  return res;
+  // clang-format on
 }
 
-static val_t parse_rtl_binop(struct parser *p, bpf_t f1, bpf_t f2,
-                             const tok_t *ops, tok_t prev_op) {
-  val_t res = MJS_TRUE;
-  (void) prev_op;
-  TRY(f1(p, TOK_EOF));
-  if (findtok(ops, p->tok.tok) != TOK_EOF) {
-    int op = p->tok.tok;
+static void save_mark(const struct parser *p, struct mark *m) {
+  m->pos = p->pos;
+  m->line_no = p->line_no;
+  m->prev_tok = p->prev_tok;
+  m->tok = p->tok;
+}
+
+static void restore_mark(struct parser *p, const struct mark *m) {
+  p->pos = m->pos;
+  p->line_no = m->line_no;
+  p->prev_tok = m->prev_tok;
+  p->tok = m->tok;
+  p->ahead_pos = NULL;
+}
+
+// Peek at the next token. It is kept, so that pnext() does not lex it again
+static tok_t lookahead(struct parser *p) {
+  if (p->ahead_pos == NULL) {
+    struct mark m;
+    save_mark(p, &m);
     pnext(p);
-    TRY(f2(p, TOK_EOF));
-    TRY(do_op(p, op));
+    p->ahead = p->tok;
+    p->ahead_line = p->line_no;
+    p->ahead_pos = p->pos;
+    p->pos = m.pos;
+    p->line_no = m.line_no;
+    p->prev_tok = m.prev_tok;
+    p->tok = m.tok;
   }
-  return res;
+  return p->ahead.tok;
 }
 
-static tok_t lookahead(struct parser *p) {
-  struct parser tmp = *p;
-  tok_t tok = pnext(p);
-  *p = tmp;
-  return tok;
+// Whether a script is out of budget and can be suspended. That is possible
+// only between statements of a top level script (not inside function calls)
+static int can_suspend(struct parser *p) {
+  struct vm *vm = p->vm;
+#if MJS_TASK_POOL_SIZE > 0
+  int yield = vm->yield;
+#else
+  int yield = 0;
+#endif
+  return p->rs != NULL && vm->sp == 0 && p->depth < MJS_RESUME_DEPTH &&
+         (yield || (vm->budget > 0 && vm->steps >= vm->budget));
+}
+
+// Count a statement or loop iteration. Code that cannot be suspended, e.g.
+// a function body, fails when it overruns the budget MJS_BUDGET_LIMIT times
+static val_t count_step(struct vm *vm) {
+  vm->steps++;
+#if MJS_BUDGET_LIMIT > 0
+  if (vm->budget > 0 && vm->steps / MJS_BUDGET_LIMIT >= vm->budget) {
+    return vm_err(vm, "budget exceeded");
+  }
+#endif
+  return MJS_TRUE;
+}
+
+// Start unwinding a suspended script. Statements on the way up record their
+// offsets into the resume path, see parse_statement()
+static val_t suspend(struct parser *p) {
+  p->rs->depth = 0;
+  p->vm->suspended = 1;
+  return MJS_ERROR;
+}
+
+// Move scopes of the blocks a suspended script sits in off the call stack
+static void save_scopes(struct vm *vm, struct resume *rs) {
+  ind_t j;
+  rs->nscopes = (ind_t)(vm->csp - rs->csp);
+  for (j = 0; j < rs->nscopes; j++) rs->scopes[j] = vm->call_stack[rs->csp + j];
+  vm->csp = rs->csp;
+}
+
+// Put them back on top of the call stack before the script resumes
+static val_t restore_scopes(struct vm *vm, struct resume *rs) {
+  ind_t j;
+  if (vm->csp + rs->nscopes >= vm->cfg.call_stack_size) {
+    vm->stats.ooms++;
+    return vm_err(vm, "Call stack OOM");
+  }
+  rs->csp = vm->csp;
+  for (j = 0; j < rs->nscopes; j++) vm->call_stack[vm->csp++] = rs->scopes[j];
+  if (vm->csp > vm->stats.call_stack_peak) vm->stats.call_stack_peak = vm->csp;
+  return MJS_TRUE;
+}
+
+#if MJS_CODE_CACHES
+static int in_pool(struct vm *vm, const char *ptr) {
+  const char *pool = (const char *) vm->stringbuf;
+  return ptr >= pool && ptr < pool + vm->cfg.string_pool_size;
+}
+
+// Compiled script that holds `ptr`, or NULL
+static struct script *script_of(struct vm *vm, const char *ptr) {
+  ind_t i;
+  for (i = 0; i < ARRSIZE(vm->scripts); i++) {
+    struct script *s = &vm->scripts[i];
+    if (s->buf != NULL && ptr >= s->buf && ptr < s->buf + s->len) return s;
+  }
+  return NULL;
+}
+
+// Function code lives in the string pool and moves only when the pool gets
+// compacted. Compiled scripts stay until mjs_release(), which drops their
+// caches. Other code may be freed by the host as soon as its script ends
+static uint32_t code_gen(struct vm *vm, const char *code) {
+  if (in_pool(vm, code)) return vm->code_gen;
+  return script_of(vm, code) != NULL ? 0 : vm->run_gen;
+}
+
+// Drop the caches that point into a buffer that is about to be reused
+static void forget_code(struct vm *vm, const char *buf, len_t len) {
+  int i;
+#if MJS_SWITCH_CACHE_SIZE > 0
+  for (i = 0; i < MJS_SWITCH_CACHE_SIZE; i++) {
+    struct swtab *t = &vm->switches[i];
+    if (t->body >= buf && t->body < buf + len) t->body = NULL;
+  }
+#endif
+#if MJS_SKIP_INDEX_SIZE > 0
+  for (i = 0; i < MJS_SKIP_INDEX_BUFS; i++) {
+    if (vm->grouptabs[i].buf == buf) vm->grouptabs[i].buf = NULL;
+  }
+#endif
+  (void) i;
+}
+#endif
+
+#if MJS_SKIP_INDEX_SIZE > 0
+// Find the bracketed groups of a source buffer the way the lexer sees them,
+// skipping strings and comments. While a group is open, its `close` links
+// to the enclosing group, plus one. Return the number of groups, or -1 if
+// they do not fit into `max` or the brackets do not match
+static int scan_groups(const char *buf, len_t len, struct group *g, int max) {
+  int n = 0, cur = -1, next;
+  len_t i, lines = 0;
+  for (i = 0; i < len && buf[i] != '\0'; i++) {
+    char c = buf[i];
+    if (c == '\n') {
+      lines++;
+    } else if (c == '\'' || c == '"') {  // Newlines in strings do not count
+      for (i++; i < len && buf[i] != '\0' && buf[i] != c; i++) {
+        if (buf[i] == '\\' && i + 1 < len && buf[i + 1] != '\0') i++;
+      }
+    } else if (c == '/' && i + 1 < len && buf[i + 1] == '/') {
+      while (i + 1 < len && buf[i + 1] != '\0' && buf[i + 1] != '\n') i++;
+    } else if (c == '/' && i + 1 < len && buf[i + 1] == '*') {
+      for (i += 2; i + 1 < len && (buf[i] != '*' || buf[i + 1] != '/'); i++) {
+        if (buf[i] == '\n') lines++;
+      }
+      i++;
+    } else if (c == '(' || c == '[' || c == '{') {
+      if (n >= max) return -1;
+      g[n].open = i;
+      g[n].close = (len_t)(cur + 1);
+      g[n].lines = lines;
+      cur = n++;
+    } else if (c == ')' || c == ']' || c == '}') {
+      char o = c == ')' ? '(' : c == ']' ? '[' : '{';
+      if (cur < 0 || buf[g[cur].open] != o) return -1;
+      next = (int) g[cur].close - 1;
+      g[cur].close = i;
+      g[cur].lines = lines - g[cur].lines;
+      cur = next;
+    }
+  }
+  return cur < 0 ? n : -1;
+}
+
+// Drop the skip indexes of all but compiled scripts
+static void drop_group_indexes(struct vm *vm) {
+  memset(vm->grouptabs, 0, sizeof(vm->grouptabs));
+  vm->groups_len = vm->groups_pinned;
+}
+
+// Skip index of the buffer being parsed, NULL if it cannot be indexed.
+// Compiled scripts have theirs made by mjs_compile(). Others are built on
+// first use, into the free part of vm->groups. Once that is full, all
+// of them are dropped and rebuilt as needed
+static const struct grouptab *group_index(struct parser *p) {
+  struct vm *vm = p->vm;
+  struct script *s = script_of(vm, p->buf);
+  struct grouptab *t;
+  uint32_t gen = code_gen(vm, p->buf);
+  len_t len = (len_t)(p->end - p->buf);
+  int i, n;
+  if (s != NULL && s->buf == p->buf) {
+    return s->index.count == INVALID_INDEX ? NULL : &s->index;
+  }
+  for (i = 0; i < MJS_SKIP_INDEX_BUFS; i++) {
+    t = &vm->grouptabs[i];
+    if (t->buf == p->buf && t->gen == gen) {
+      return t->count == INVALID_INDEX ? NULL : t;
+    }
+  }
+  t = &vm->grouptabs[vm->grouptab_next];
+  vm->grouptab_next = (uint8_t)((vm->grouptab_next + 1) % MJS_SKIP_INDEX_BUFS);
+  n = scan_groups(p->buf, len, &vm->groups[vm->groups_len],
+                  MJS_SKIP_INDEX_SIZE - vm->groups_len);
+  if (n < 0 && vm->groups_len > vm->groups_pinned) {
+    drop_group_indexes(vm);
+    n = scan_groups(p->buf, len, &vm->groups[vm->groups_len],
+                    MJS_SKIP_INDEX_SIZE - vm->groups_len);
+  }
+  t->buf = p->buf;
+  t->gen = gen;
+  t->first = vm->groups_len;
+  t->count = n < 0 ? INVALID_INDEX : (ind_t) n;
+  if (n > 0) vm->groups_len = (ind_t)(vm->groups_len + n);
+  return n < 0 ? NULL : t;
+}
+
+// Build the skip index of a compiled script, after those of the others
+static void pin_group_index(struct vm *vm, struct script *s) {
+  int n;
+  drop_group_indexes(vm);
+  n = scan_groups(s->buf, s->len, &vm->groups[vm->groups_pinned],
+                  MJS_SKIP_INDEX_SIZE - vm->groups_pinned);
+  s->index.buf = s->buf;
+  s->index.gen = 0;
+  s->index.first = vm->groups_pinned;
+  s->index.count = n < 0 ? INVALID_INDEX : (ind_t) n;
+  if (n > 0) vm->groups_pinned = (ind_t)(vm->groups_pinned + n);
+  vm->groups_len = vm->groups_pinned;
+}
+
+// Give back the groups of a released script, moving down those after them
+static void unpin_group_index(struct vm *vm, struct script *s) {
+  ind_t i, first = s->index.first, n = s->index.count;
+  if (n != INVALID_INDEX && n > 0) {
+    memmove(&vm->groups[first], &vm->groups[first + n],
+            (size_t)(vm->groups_pinned - first - n) * sizeof(vm->groups[0]));
+    for (i = 0; i < ARRSIZE(vm->scripts); i++) {
+      struct grouptab *t = &vm->scripts[i].index;
+      if (vm->scripts[i].buf != NULL && t->first > first) {
+        t->first = (ind_t)(t->first - n);
+      }
+    }
+    vm->groups_pinned = (ind_t)(vm->groups_pinned - n);
+    drop_group_indexes(vm);
+  }
+  memset(&s->index, 0, sizeof(s->index));
+}
+#endif
+
+// Move the parser from an opening bracket straight to its closing one, if
+// the skip index is enabled. Return 0 if the parser was left where it is
+static int jump_to_close(struct parser *p) {
+#if MJS_SKIP_INDEX_SIZE > 0
+  const struct grouptab *t = group_index(p);
+  len_t off = (len_t)(p->tok.ptr - p->buf);
+  int lo, hi, mid;
+  if (t == NULL) return 0;
+  for (lo = t->first, hi = t->first + t->count - 1; lo <= hi;) {
+    const struct group *g = &p->vm->groups[mid = (lo + hi) / 2];
+    if (g->open < off) {
+      lo = mid + 1;
+    } else if (g->open > off) {
+      hi = mid - 1;
+    } else {
+      p->pos = p->buf + g->close;
+      p->line_no += (int) g->lines;
+      p->ahead_pos = NULL;
+      pnext(p);
+      return 1;
+    }
+  }
+  return 0;
+#else
+  (void) p;
+  return 0;
+#endif
 }
 
 static val_t parse_block(struct parser *p, int mkscope) {
   val_t res = MJS_TRUE;
-  if (mkscope && !p->noexec) TRY(create_scope(p->vm));
+  // When resuming, the block scope has been left on the call stack
+  if (mkscope && !p->noexec && !p->seek) TRY(create_scope(p->vm));
   TRY(parse_statement_list(p, '}'));
-  EXPECT(p, '}');
+  if (p->flow == FLOW_NONE) EXPECT(p, '}');  // A jump leaves the block midway
   if (mkscope && !p->noexec) TRY(delete_scope(p->vm));
   return res;
 }
@@ -1002,14 +1886,16 @@ static val_t parse_function(struct parser *p) {
   }
   EXPECT(p, ')');
   pnext(p);
-  TRY(parse_block(p, 0));
+  EXPECT(p, '{');
+  // Defined at run time: the body gets parsed once the function is called
+  if (p->noexec > 1 || !jump_to_close(p)) TRY(parse_block(p, 0));
   if (name_provided) TRY(do_op(p, '='));
-  {
+  p->noexec--;
+  if (!p->noexec) {
     val_t f = mk_func(p->vm, tmp.ptr, p->tok.ptr - tmp.ptr + 1);
     TRY(f);
     res = vm_push(p->vm, f);
   }
-  p->noexec--;
   LOG((DBGPREFIX "%s: STOP: [%d]\n", __func__, p->vm->sp));
   return res;
 }
@@ -1025,7 +1911,7 @@ static val_t parse_object_literal(struct parser *p) {
   while (p->tok.tok != '}') {
     if (p->tok.tok != TOK_IDENT && p->tok.tok != TOK_STR)
       return vm_err(p->vm, "error parsing obj key");
-    key = mk_str(p->vm, p->tok.ptr, p->tok.len);
+    key = p->noexec ? MJS_UNDEFINED : mk_str(p->vm, p->tok.ptr, p->tok.len);
     TRY(key);
     pnext(p);
     EXPECT(p, ':');
@@ -1046,6 +1932,11 @@ static val_t parse_object_literal(struct parser *p) {
   return res;
 }
 
+// True if `tok` continues a member access or call chain
+static int continues_chain(tok_t tok) {
+  return tok == '.' || tok == '(' || tok == '[';
+}
+
 static val_t parse_literal(struct parser *p, tok_t prev_op) {
   val_t res = MJS_TRUE;
   (void) prev_op;
@@ -1070,7 +1961,7 @@ static val_t parse_literal(struct parser *p, tok_t prev_op) {
         tok_t next_tok = lookahead(p);
         if (!findtok(s_assign_ops, next_tok) &&
             !findtok(s_postfix_ops, next_tok) &&
-            !findtok(s_postfix_ops, prev_tok)) {
+            (!findtok(s_postfix_ops, prev_tok) || continues_chain(next_tok))) {
           // Get value
           res = lookup_and_push(p->vm, p->tok.ptr, p->tok.len);
         } else {
@@ -1080,12 +1971,10 @@ static val_t parse_literal(struct parser *p, tok_t prev_op) {
           if (v == NULL) {
             return vm_err(p->vm, "doh");
           } else {
-            // Push the index of a property that holds this key
-            size_t off = offsetof(struct prop, val);
-            struct prop *prop = (struct prop *) ((char *) v - off);
-            ind_t ind = (ind_t)(prop - p->vm->props);
+            // Push a reference to the property that holds this key
+            ind_t ind = (ind_t)(v - p->vm->prop_vals);
             LOG((DBGPREFIX "   ind %d\n", ind));
-            TRY(vm_push(p->vm, tov(ind)));
+            TRY(vm_push(p->vm, MK_REF(ind)));
           }
         }
       }
@@ -1094,16 +1983,16 @@ static val_t parse_literal(struct parser *p, tok_t prev_op) {
       res = parse_function(p);
       break;
     case TOK_TRUE:
-      res = vm_push(p->vm, MJS_TRUE);
+      if (!p->noexec) res = vm_push(p->vm, MJS_TRUE);
       break;
     case TOK_FALSE:
-      res = vm_push(p->vm, MJS_FALSE);
+      if (!p->noexec) res = vm_push(p->vm, MJS_FALSE);
       break;
     case TOK_NULL:
-      res = vm_push(p->vm, MJS_NULL);
+      if (!p->noexec) res = vm_push(p->vm, MJS_NULL);
       break;
     case TOK_UNDEFINED:
-      res = vm_push(p->vm, MJS_UNDEFINED);
+      if (!p->noexec) res = vm_push(p->vm, MJS_UNDEFINED);
       break;
     case '(':
       pnext(p);
@@ -1128,43 +2017,211 @@ static void setarg(struct parser *p, val_t scope, val_t val) {
   pnext(p);
 }
 
-static val_t call_js_function(struct parser *p, val_t f) {
-  val_t res = MJS_TRUE;
-  ind_t saved_scp = p->vm->csp;
-  val_t scope;  // Function to call
+#if MJS_PROFILE_SIZE > 0
+// Profiler. Every statement run is counted against its source line, and its
+// self time is added up: its run time minus that of the statements nested in
+// it, including the statements of the functions it calls. Entries are keyed
+// by the calling statement too, which gives call stacks for flame graphs
+struct prof_mark {
+  ind_t entry;            // Entry of the statement
+  ind_t saved_cur;        // Entry of the enclosing statement
+  uint32_t start;         // When the statement started
+  uint32_t saved_child;   // Nested statements time of the enclosing one
+};
 
-  // Create parser for the function code
-  len_t code_len;
-  char *code = mjs_to_str(p->vm, f, &code_len);
-  struct parser p2 = mk_parser(p->vm, code, code_len);
+static uint32_t prof_clock(struct vm *vm) {
+  return vm->clock == NULL ? 0 : vm->clock();
+}
 
-  // Create scope
-  TRY(create_scope(p->vm));
-  scope = p->vm->call_stack[p->vm->csp - 1];
+// Find the entry of a line of the current function, add it if not found
+static ind_t prof_entry(struct vm *vm, int line) {
+  ind_t i, n, parent = vm->prof_frame;
+  uint16_t ln = (uint16_t)(line > 0xffff ? 0xffff : line);
+  i = (ind_t)(((uint32_t) parent * 31 + vm->prof_func * 7U + ln) %
+              MJS_PROFILE_SIZE);
+  for (n = 0; n < MJS_PROFILE_SIZE; n++) {
+    struct prof *e = &vm->prof[i];
+    if (!e->used) {
+      e->used = 1;
+      e->parent = parent;
+      e->line = ln;
+      e->func = vm->prof_func;
+      return i;
+    }
+    if (e->parent == parent && e->line == ln && e->func == vm->prof_func) {
+      return i;
+    }
+    if (++i >= MJS_PROFILE_SIZE) i = 0;
+  }
+  return INVALID_INDEX;
+}
+
+static void prof_enter(struct parser *p, struct prof_mark *m) {
+  struct vm *vm = p->vm;
+  m->entry = prof_entry(vm, p->line_no);
+  m->saved_cur = vm->prof_cur;
+  m->saved_child = vm->prof_child;
+  vm->prof_cur = m->entry;
+  vm->prof_child = 0;
+  m->start = prof_clock(vm);
+}
+
+static void prof_leave(struct vm *vm, const struct prof_mark *m) {
+  uint32_t t = prof_clock(vm) - m->start;
+  if (m->entry != INVALID_INDEX) {
+    vm->prof[m->entry].count++;
+    vm->prof[m->entry].time += t - vm->prof_child;
+  } else {
+    vm->prof_lost++;
+  }
+  vm->prof_cur = m->saved_cur;
+  vm->prof_child = m->saved_child + t;
+}
+
+// Remember the name a function is called by: the identifier before the `(`
+// that precedes the arguments starting at `args`
+static void prof_callee(struct vm *vm, const char *buf, const char *args) {
+  const char *end;
+  while (args > buf && mjs_is_space(args[-1])) args--;
+  if (args > buf && args[-1] == '(') args--;
+  while (args > buf && mjs_is_space(args[-1])) args--;
+  end = args;
+  while (args > buf && (mjs_is_ident(args[-1]) || mjs_is_digit(args[-1]))) {
+    args--;
+  }
+  vm->callee = args;
+  vm->callee_len = (int) (end - args);
+}
+
+// Return index of a function name, adding it to the names table. The first
+// slot is taken by the top level code, the last one by all functions that
+// did not fit
+static uint8_t prof_func(struct vm *vm, const char *name, int len) {
+  int i;
+  if (len >= MJS_PROFILE_NAME_SIZE) len = MJS_PROFILE_NAME_SIZE - 1;
+  for (i = 1; i < MJS_PROFILE_FUNCS - 1; i++) {
+    char *s = vm->prof_funcs[i];
+    if (s[0] == '\0') {
+      memcpy(s, name, (size_t) len);
+      s[len] = '\0';
+    }
+    if (strncmp(s, name, (size_t) len) == 0 && s[len] == '\0') break;
+  }
+  return (uint8_t) i;
+}
+
+// Make the function being called the current one, see call_js()
+static void prof_call(struct vm *vm) {
+  const char *name = vm->callee;
+  int len = vm->callee_len;
+  if (name == NULL || len == 0) name = "(anonymous)", len = 11;
+  vm->prof_frame = vm->prof_cur;
+  vm->prof_func = prof_func(vm, name, len);
+  vm->callee = NULL;
+}
+
+// Print frames of the call stack of entry `i` into `buf`, outermost first
+static int prof_stack(struct vm *vm, ind_t i, char *buf, int size) {
+  struct prof *e = &vm->prof[i];
+  int n = 0;
+  if (e->parent != INVALID_INDEX) {
+    n = prof_stack(vm, e->parent, buf, size);
+    if (n < size - 1) buf[n++] = ';';
+  }
+  if (n < size - 1) {
+    n += snprintf(buf + n, (size_t)(size - n), "%s:%d",
+                  vm->prof_funcs[e->func], (int) e->line);
+  }
+  return n < size ? n : size - 1;
+}
+#endif
+
+// Call JS function `f`, binding `argc` values from `argv` to its parameters.
+// `f` sits on the data stack, followed by `nstack` values that are dropped
+// once bound. The result of the call replaces `f` on the data stack.
+static val_t call_js(struct vm *vm, val_t f, int argc, const val_t *argv,
+                     int nstack) {
+  val_t res = MJS_TRUE, scope;
+  ind_t saved_scp = vm->csp;
+  int i;
+#if MJS_HISTOGRAM_BUCKETS > 0
+  uint32_t start = hist_start(vm);
+#endif
+#if MJS_PROFILE_SIZE > 0
+  ind_t saved_frame = vm->prof_frame;
+  uint8_t saved_func = vm->prof_func;
+#endif
+
+  // Create parser for the function code
+  len_t code_len;
+  char *code = mjs_to_str(vm, f, &code_len);
+  struct parser p2 = mk_parser(vm, code, code_len);
+#if MJS_TRACE
+  uint16_t saved_line = vm->line;
+#endif
+
+  // Create scope
+  TRY(create_scope(vm));
+  scope = vm->call_stack[vm->csp - 1];
   LOG((DBGPREFIX "%s: %d [%.*s]\n", __func__, mjs_type(scope), code_len, code));
 
-  // Skip `function(` in the function definition
-  pnext(&p2);
+  // Skip `function(` or `function name(` in the function definition
   pnext(&p2);
+  if (pnext(&p2) == TOK_IDENT) {
+#if MJS_PROFILE_SIZE > 0
+    vm->callee = p2.tok.ptr;  // Own name takes precedence
+    vm->callee_len = (int) p2.tok.len;
+#endif
+    pnext(&p2);
+  }
   pnext(&p2);  // Now p2.tok points either to the first argument, or to the ')'
 
-  // Parse parameters, populate the scope as local variables
+  // Populate the scope with arguments as local variables
+  for (i = 0; p2.tok.tok == TOK_IDENT; i++) {
+    setarg(&p2, scope, i < argc ? argv[i] : MJS_UNDEFINED);
+  }
+  for (i = 0; i < nstack; i++) vm_drop(vm);  // Arguments are bound, drop them
+  vm_drop(vm);  // Drop function, the body leaves the result in its place
+  // printf(" local scope: %s\n", tostr(vm, scope));
+  while (p2.tok.tok != '{') pnext(&p2);  // Skip to the function body
+#if MJS_PROFILE_SIZE > 0
+  prof_call(vm);
+#endif
+  TRACE(vm, MJS_TRACE_CALL, f);
+  res = parse_block(&p2, 0);             // Execute function body
+#if MJS_TRACE
+  vm->line = saved_line;
+#endif
+  LOG((DBGPREFIX "%s: R sp %d\n", __func__, vm->sp));
+  while (vm->csp > saved_scp) delete_scope(vm);  // Restore current scope
+#if MJS_PROFILE_SIZE > 0
+  vm->prof_frame = saved_frame;
+  vm->prof_func = saved_func;
+#endif
+#if MJS_HISTOGRAM_BUCKETS > 0
+  hist_add(vm, MJS_HIST_JS_CALL, start);
+#endif
+  return res;
+}
+
+static val_t call_js_function(struct parser *p, val_t f) {
+  val_t res = MJS_TRUE, *top = vm_top(p->vm);
+  int argc = 0;
+#if MJS_PROFILE_SIZE > 0
+  const char *args = p->tok.ptr;
+#endif
+
+  // Evaluate all JS arguments, push them on the data stack
   while (p->tok.tok != ')') {
-    // Evaluate next argument - pushed to the data_stack
     TRY(parse_expr(p));
     if (p->tok.tok == ',') pnext(p);
-    // Check whether we have a defined name for this argument
-    if (p2.tok.tok == TOK_IDENT) setarg(&p2, scope, *vm_top(p->vm));
-    vm_drop(p->vm);  // Drop argument value from the data_stack
+    argc++;
     LOG((DBGPREFIX "%s: P sp %d\n", __func__, p->vm->sp));
   }
-  // printf(" local scope: %s\n", tostr(p->vm, scope));
-  while (p2.tok.tok == TOK_IDENT) setarg(&p2, scope, MJS_UNDEFINED);
-  while (p2.tok.tok != '{') pnext(&p2);  // Skip to the function body
-  res = parse_block(&p2, 0);             // Execute function body
-  LOG((DBGPREFIX "%s: R sp %d\n", __func__, p->vm->sp));
-  while (p->vm->csp > saved_scp) delete_scope(p->vm);  // Restore current scope
-  return res;
+#if MJS_PROFILE_SIZE > 0
+  prof_callee(p->vm, p->buf, args);
+#endif
+  return call_js(p->vm, f, argc, top + 1, argc);
 }
 
 #define FFI_MAX_ARGS_CNT 6
@@ -1750,27 +2807,27 @@ struct fficbparam {
 };
 
 static ffi_word_t fficb(struct fficbparam *cbp, union ffi_val *args) {
-  char buf[100];
-  int num_args = 0, n = 0;
+  val_t argv[FFI_MAX_ARGS_CNT], res = MJS_UNDEFINED;
+  int num_args = 0;
   const char *s;
-  struct parser p2;
-  val_t res;
   for (s = cbp->decl + 1; *s != '\0' && *s != ']'; s++) {
     // clang-format off
-    if (num_args > 0) n += snprintf(buf + n, sizeof(buf) - n, "%s", ",");
     switch (*s) {
-      case 'i': n += snprintf(buf + n, sizeof(buf) - n, "%d", (int) args[num_args].i); break;
-      default: n += snprintf(buf + n, sizeof(buf) - n, "null"); break;
+      case 'i': argv[num_args] = tov((mjs_num_t) (int) args[num_args].i); break;
+      default: argv[num_args] = MJS_NULL; break;
     }
     // clang-format on
-    num_args++;
+    if (++num_args >= FFI_MAX_ARGS_CNT) break;
   }
-  n += snprintf(buf + n, sizeof(buf) - n, "%s", ")");
-  // printf("js cb: %p '%s'\n", cbp, buf);
-  p2 = mk_parser(cbp->p->vm, buf, n);
-  pnext(&p2);
-  call_js_function(&p2, cbp->jsfunc);
-  res = *vm_top(cbp->p->vm);
+#if MJS_HISTOGRAM_BUCKETS > 0
+  {
+    uint32_t start = hist_start(cbp->p->vm);
+    mjs_call(cbp->p->vm, cbp->jsfunc, num_args, argv, &res);
+    hist_add(cbp->p->vm, MJS_HIST_CALLBACK, start);
+  }
+#else
+  mjs_call(cbp->p->vm, cbp->jsfunc, num_args, argv, &res);
+#endif
   // printf("js cb res: %s\n", tostr(cbp->p->vm, res));
   return (ffi_word_t) tof(res);
 }
@@ -1849,7 +2906,7 @@ static val_t call_c_function(struct parser *p, val_t f) {
   val_t res = MJS_UNDEFINED, v = MJS_UNDEFINED, *top = vm_top(p->vm);
   struct ffi_arg args[FFI_MAX_ARGS_CNT + 1];  // First arg - return value
   struct fficbparam cbp;                      // For C callbacks only
-  int i, num_passed_args = 0, num_expected_args = 0;
+  int i, num_passed_args = 0, num_expected_args = 0, num_ffi_args = 0;
 
   // Evaluate all JS parameters passed to the C function, push them on stack
   while (p->tok.tok != ')') {
@@ -1871,10 +2928,14 @@ static val_t call_c_function(struct parser *p, val_t f) {
 	}
 	// Prepare FFI arguments - fetch them from the passed JS arguments
 	for (i = 1; cf->decl[i] != '\0'; i++) {  // Start from 1 to skip ret value
-		struct ffi_arg *arg = &args[num_expected_args + 1];
+		struct ffi_arg *arg = &args[num_ffi_args + 1];
 		val_t av = top[num_expected_args + 1];
 		//printf("--> arg [%c] [%s]\n", cf->decl[i], tostr(p->vm, av));
+		if (num_ffi_args >= FFI_MAX_ARGS_CNT) return vm_err(p->vm, "ffi call %s: too many args", cf->decl);
+		num_ffi_args++;
 		switch (cf->decl[i]) {
+			case 'm': ffi_set_ptr(arg, p->vm); continue;  // Not a JS argument
+			case 'j': ffi_set_word(arg, (ffi_word_t) av); break;
 			case '[': ffi_set_ptr(arg, (void *) setfficb(p, av, &cbp, cf->decl, &i)); break;
 			case 'u': ffi_set_ptr(arg, &cbp); break;
 			case 's': ffi_set_ptr(arg, mjs_to_str(p->vm, av, 0)); break;
@@ -1888,12 +2949,22 @@ static val_t call_c_function(struct parser *p, val_t f) {
 
 	if (num_passed_args != num_expected_args) return vm_err(p->vm, "ffi call %s: %d vs %d", cf->decl, num_expected_args, num_passed_args);
 
-	ffi_call(cf->fn, num_passed_args, &args[0], &args[1]);
+	p->vm->stats.ffi_calls++;
+	TRACE(p->vm, MJS_TRACE_FFI, f);
+#if MJS_HISTOGRAM_BUCKETS > 0
+	{
+		uint32_t start = hist_start(p->vm);
+		ffi_call(cf->fn, num_ffi_args, &args[0], &args[1]);
+		hist_add(p->vm, MJS_HIST_C_CALL, start);
+	}
+#else
+	ffi_call(cf->fn, num_ffi_args, &args[0], &args[1]);
+#endif
 	switch (cf->decl[0]) {
 		case 's': v = mk_str(p->vm, (char *) args[0].v.i, -1); break;
 		case 'f': v = tov(args[0].v.f); break;
-		case 'F': v = tov((float) args[0].v.d); break;
-		default: v = tov((float) args[0].v.i); break;
+		case 'F': v = tov((mjs_num_t) args[0].v.d); break;
+		default: v = tov((mjs_num_t) args[0].v.i); break;
 	}
   // clang-format on
         while (vm_top(p->vm) > top) vm_drop(p->vm);  // Abandon pushed args
@@ -1902,8 +2973,9 @@ static val_t call_c_function(struct parser *p, val_t f) {
         return vm_push(p->vm, v);  // Push call result
 }
 
-static val_t parse_call_dot_mem(struct parser *p, int prev_op) {
+static val_t parse_call_dot_mem(struct parser *p) {
   val_t res = MJS_TRUE;
+  tok_t prefix = p->prev_tok;  // Prefix ++ or -- applies to the whole chain
   TRY(parse_literal(p, p->tok.tok));
   while (p->tok.tok == '.' || p->tok.tok == '(' || p->tok.tok == '[') {
     if (p->tok.tok == '[') {
@@ -1925,7 +2997,6 @@ static val_t parse_call_dot_mem(struct parser *p, int prev_op) {
           TRY(parse_expr(p));
           if (p->tok.tok == ',') pnext(p);
         }
-        return res;
       } else {
         val_t f = *vm_top(p->vm);
         mjs_type_t t = mjs_type(f);
@@ -1936,14 +3007,18 @@ static val_t parse_call_dot_mem(struct parser *p, int prev_op) {
         } else {
           res = vm_err(p->vm, "calling non-func");
         }
+        if (res == MJS_ERROR) return res;
       }
       EXPECT(p, ')');
       pnext(p);
     } else if (p->tok.tok == '.') {
-      val_t v = *vm_top(p->vm);
+      struct tok name;
+      pnext(p);
+      name = p->tok;
       pnext(p);
       if (!p->noexec) {
-        if (p->tok.len == 6 && memcmp(p->tok.ptr, "length", 6) == 0 &&
+        val_t v = *vm_top(p->vm);
+        if (name.len == 6 && memcmp(name.ptr, "length", 6) == 0 &&
             mjs_type(v) == MJS_TYPE_STRING) {
           len_t len;
           mjs_to_str(p->vm, v, &len);
@@ -1951,120 +3026,231 @@ static val_t parse_call_dot_mem(struct parser *p, int prev_op) {
           res = vm_push(p->vm, tov(len));
         } else if (mjs_type(v) != MJS_TYPE_OBJECT) {
           res = vm_push(p->vm, vm_err(p->vm, "lookup in non-obj"));
+        } else if (findtok(s_assign_ops, p->tok.tok) ||
+                   findtok(s_postfix_ops, p->tok.tok) ||
+                   (findtok(s_postfix_ops, prefix) &&
+                    !continues_chain(p->tok.tok))) {
+          // Assignment to a member. Like for variables, push a reference to
+          // the property that holds it. Only plain '=' adds a missing one:
+          // ++, -- and compound ops need an existing value
+          val_t *prop = findprop(p->vm, v, name.ptr, name.len);
+          if (prop == NULL && p->tok.tok != '=') {
+            return vm_err(p->vm, "[%.*s] undefined", name.len, name.ptr);
+          } else if (prop == NULL) {
+            val_t key = mk_str(p->vm, name.ptr, name.len);
+            TRY(key);
+            TRY(mjs_set(p->vm, v, key, MJS_UNDEFINED));
+            prop = findprop(p->vm, v, name.ptr, name.len);
+          }
+          vm_drop(p->vm);
+          res = vm_push(p->vm, MK_REF(prop - p->vm->prop_vals));
         } else {
-          val_t *prop = findprop(p->vm, v, p->tok.ptr, p->tok.len);
+          val_t *prop = findprop(p->vm, v, name.ptr, name.len);
           vm_drop(p->vm);
           res = vm_push(p->vm, prop == NULL ? MJS_UNDEFINED : *prop);
         }
       }
-      pnext(p);
     }
   }
-  (void) prev_op;
-  return res;
-}
-
-static val_t parse_postfix(struct parser *p, int prev_op) {
-  val_t res = MJS_TRUE;
-  TRY(parse_call_dot_mem(p, prev_op));
-  if (p->tok.tok == DT('+', '+') || p->tok.tok == DT('-', '-')) {
-    int op = p->tok.tok == DT('+', '+') ? TOK_POSTFIX_PLUS : TOK_POSTFIX_MINUS;
-    TRY(do_op(p, op));
-    pnext(p);
-  }
   return res;
 }
 
-static val_t parse_unary(struct parser *p, int prev_op) {
+// Unary operators, a primary expression and postfix operators
+static val_t parse_unary(struct parser *p) {
   val_t res = MJS_TRUE;
   int op = TOK_EOF;
   if (findtok(s_unary_ops, p->tok.tok) != TOK_EOF) {
     op = p->tok.tok;
     pnext(p);
-  }
-  if (findtok(s_unary_ops, p->tok.tok) != TOK_EOF) {
-    res = parse_unary(p, prev_op);
-  } else {
-    res = parse_postfix(p, prev_op);
-  }
-  if (res == MJS_ERROR) return res;
-  if (op != TOK_EOF) {
+    TRY(parse_unary(p));
     if (op == '-') op = TOK_UNARY_MINUS;
     if (op == '+') op = TOK_UNARY_PLUS;
-    do_op(p, op);
+    return do_op(p, op);
+  }
+  TRY(parse_call_dot_mem(p));
+  if (p->tok.tok == DT('+', '+') || p->tok.tok == DT('-', '-')) {
+    op = p->tok.tok == DT('+', '+') ? TOK_POSTFIX_PLUS : TOK_POSTFIX_MINUS;
+    TRY(do_op(p, op));
+    pnext(p);
   }
   return res;
 }
 
-static val_t parse_mul_div_rem(struct parser *p, int prev_op) {
-  tok_t ops[] = {'*', '/', '%', TOK_EOF};
-  return parse_ltr_binop(p, parse_unary, parse_mul_div_rem, ops, prev_op);
-}
-
-static val_t parse_plus_minus(struct parser *p, int prev_op) {
-  tok_t ops[] = {'+', '-', TOK_EOF};
-  return parse_ltr_binop(p, parse_mul_div_rem, parse_plus_minus, ops, prev_op);
-}
-
-static val_t parse_shifts(struct parser *p, int prev_op) {
-  tok_t ops[] = {DT('<', '<'), DT('>', '>'), TT('>', '>', '>'), TOK_EOF};
-  return parse_ltr_binop(p, parse_plus_minus, parse_shifts, ops, prev_op);
-}
-
-static val_t parse_comparison(struct parser *p, int prev_op) {
-  return parse_ltr_binop(p, parse_shifts, parse_comparison, s_cmp_ops, prev_op);
-}
-
-static val_t parse_equality(struct parser *p, int prev_op) {
-  return parse_ltr_binop(p, parse_comparison, parse_equality, s_equality_ops,
-                         prev_op);
+// Skip a bracketed group, starting at its opening bracket
+static val_t skip_group(struct parser *p) {
+  int depth = 0;
+  if (jump_to_close(p)) {
+    pnext(p);
+    return MJS_TRUE;
+  }
+  do {
+    // clang-format off
+    switch (p->tok.tok) {
+      case '(': case '[': case '{': depth++; break;
+      case ')': case ']': case '}': depth--; break;
+      case TOK_EOF: return vm_err(p->vm, "unbalanced brackets");
+    }
+    // clang-format on
+    pnext(p);
+  } while (depth > 0);
+  return MJS_TRUE;
 }
 
-static val_t parse_bitwise_and(struct parser *p, int prev_op) {
-  tok_t ops[] = {'&', TOK_EOF};
-  return parse_ltr_binop(p, parse_equality, parse_bitwise_and, ops, prev_op);
+// Skip an operand: prefix operators, a primary expression with its member
+// accesses and calls, and a postfix operator
+static val_t skip_operand(struct parser *p) {
+  val_t res = MJS_TRUE;
+  while (findtok(s_unary_ops, p->tok.tok) != TOK_EOF) pnext(p);
+  switch (p->tok.tok) {
+    case TOK_FUNCTION:
+      pnext(p);
+      if (p->tok.tok == TOK_IDENT) pnext(p);
+      EXPECT(p, '(');
+      TRY(skip_group(p));
+      EXPECT(p, '{');
+      TRY(skip_group(p));
+      break;
+    // clang-format off
+    case '(': case '[': case '{':
+      TRY(skip_group(p));
+      break;
+    case TOK_NUM: case TOK_STR: case TOK_IDENT: case TOK_TRUE: case TOK_FALSE:
+    case TOK_NULL: case TOK_UNDEFINED:
+      // clang-format on
+      pnext(p);
+      break;
+    default:
+      return vm_err(p->vm, "Bad literal: [%.*s]", p->tok.len, p->tok.ptr);
+  }
+  for (;;) {
+    if (p->tok.tok == '.') {
+      pnext(p);
+      pnext(p);
+    } else if (p->tok.tok == '(' || p->tok.tok == '[') {
+      TRY(skip_group(p));
+    } else {
+      break;
+    }
+  }
+  if (findtok(s_postfix_ops, p->tok.tok) != TOK_EOF) pnext(p);
+  return res;
 }
 
-static val_t parse_bitwise_xor(struct parser *p, int prev_op) {
-  tok_t ops[] = {'^', TOK_EOF};
-  return parse_ltr_binop(p, parse_bitwise_and, parse_bitwise_xor, ops, prev_op);
+// Skip an expression that parse_binary() would parse with the same
+// `min_prec`, without executing or fully parsing it
+static val_t skip_binary(struct parser *p, int min_prec) {
+  val_t res = MJS_TRUE;
+  int prec;
+  for (;;) {
+    TRY(skip_operand(p));
+    prec = binop_prec(p->tok.tok);
+    if (prec == PREC_NONE || prec < min_prec) break;
+    if (p->tok.tok == '?') {
+      pnext(p);
+      TRY(skip_binary(p, PREC_ASSIGN));
+      EXPECT(p, ':');
+    }
+    pnext(p);
+  }
+  return res;
 }
 
-static val_t parse_bitwise_or(struct parser *p, int prev_op) {
-  tok_t ops[] = {'|', TOK_EOF};
-  return parse_ltr_binop(p, parse_bitwise_xor, parse_bitwise_or, ops, prev_op);
+// Skip a statement without running it, leaving the parser where
+// parse_statement() would
+static val_t skip_statement(struct parser *p) {
+  val_t res = MJS_TRUE;
+  switch (p->tok.tok) {
+    case '{':
+      return skip_group(p);
+    case TOK_IF:
+    case TOK_WHILE:
+    case TOK_FOR:
+      pnext(p);
+      EXPECT(p, '(');
+      TRY(skip_group(p));
+      return skip_statement(p);
+    case TOK_SWITCH:
+      pnext(p);
+      EXPECT(p, '(');
+      TRY(skip_group(p));
+      EXPECT(p, '{');
+      return skip_group(p);
+    case TOK_DO:
+      pnext(p);
+      TRY(skip_statement(p));
+      while (p->tok.tok == ';') pnext(p);
+      EXPECT(p, TOK_WHILE);
+      pnext(p);
+      EXPECT(p, '(');
+      return skip_group(p);
+    default:  // Up to the ';' or '}' that ends it, or a switch label
+      while (p->tok.tok != ';' && p->tok.tok != '}' && p->tok.tok != TOK_EOF &&
+             p->tok.tok != TOK_CASE && p->tok.tok != TOK_DEFAULT) {
+        if (p->tok.tok == '(' || p->tok.tok == '[' || p->tok.tok == '{') {
+          TRY(skip_group(p));
+        } else if (p->tok.tok == ')' || p->tok.tok == ']') {
+          return vm_err(p->vm, "unbalanced brackets");
+        } else {
+          pnext(p);
+        }
+      }
+      return res;
+  }
 }
 
-static val_t parse_logical_and(struct parser *p, int prev_op) {
-  tok_t ops[] = {DT('&', '&'), TOK_EOF};
-  return parse_ltr_binop(p, parse_bitwise_or, parse_logical_and, ops, prev_op);
+// Ternary operator, the condition being on the stack. Only the branch it
+// selects is run, the other one is skipped
+static val_t parse_ternary(struct parser *p) {
+  val_t res = MJS_TRUE;
+  int cond = 0;
+  if (!p->noexec) {
+    cond = is_true(p->vm, *vm_top(p->vm));
+    vm_drop(p->vm);
+  }
+  TRY(cond || p->noexec ? parse_binary(p, PREC_ASSIGN)
+                        : skip_binary(p, PREC_ASSIGN));
+  EXPECT(p, ':');
+  pnext(p);
+  return !cond || p->noexec ? parse_binary(p, PREC_TERNARY)
+                            : skip_binary(p, PREC_TERNARY);
 }
 
-static val_t parse_logical_or(struct parser *p, int prev_op) {
-  tok_t ops[] = {DT('|', '|'), TOK_EOF};
-  return parse_ltr_binop(p, parse_logical_and, parse_logical_or, ops, prev_op);
+// Logical && and ||, the left operand being on the stack. If it decides the
+// result, it is the value of the expression and the right one is skipped
+static val_t parse_logical(struct parser *p, tok_t op, int prec) {
+  if (!p->noexec) {
+    int cond = is_true(p->vm, *vm_top(p->vm));
+    if (cond == (op == DT('|', '|'))) return skip_binary(p, prec + 1);
+    vm_drop(p->vm);
+  }
+  return parse_binary(p, prec + 1);
 }
 
-static val_t parse_ternary(struct parser *p, int prev_op) {
+// Precedence climbing: parse an operand, then keep folding in binary
+// operators that bind at least as tight as `min_prec`. The right operand
+// of each operator is parsed one level higher, or at the same level for
+// right-associative assignments
+static val_t parse_binary(struct parser *p, int min_prec) {
   val_t res = MJS_TRUE;
-  TRY(parse_logical_or(p, TOK_EOF));
-  if (prev_op != TOK_EOF) do_op(p, prev_op);
-  if (p->tok.tok == '?') {
-    pnext(p);
-    TRY(parse_ternary(p, TOK_EOF));
-    EXPECT(p, ':');
+  int prec;
+  TRY(parse_unary(p));
+  while ((prec = binop_prec(p->tok.tok)) >= min_prec && prec != PREC_NONE) {
+    tok_t op = p->tok.tok;
     pnext(p);
-    TRY(parse_ternary(p, TOK_EOF));
+    if (op == '?') {
+      TRY(parse_ternary(p));
+    } else if (prec == PREC_OR || prec == PREC_AND) {
+      TRY(parse_logical(p, op, prec));
+    } else {
+      TRY(parse_binary(p, prec == PREC_ASSIGN ? prec : prec + 1));
+      TRY(do_op(p, op));
+    }
   }
   return res;
 }
 
-static val_t parse_assignment(struct parser *p, int pop) {
-  return parse_rtl_binop(p, parse_ternary, parse_assignment, s_assign_ops, pop);
-}
-
 static val_t parse_expr(struct parser *p) {
-  return parse_assignment(p, TOK_EOF);
+  return parse_binary(p, PREC_ASSIGN);
 }
 
 static val_t parse_let(struct parser *p) {
@@ -2074,23 +3260,25 @@ static val_t parse_let(struct parser *p) {
     struct tok tmp = p->tok;
     val_t obj = p->vm->call_stack[p->vm->csp - 1], key, val = MJS_UNDEFINED;
     if (p->tok.tok != TOK_IDENT) return vm_err(p->vm, "indent expected");
-    if (findprop(p->vm, obj, p->tok.ptr, p->tok.len) != NULL) {
+    if (!p->noexec && findprop(p->vm, obj, p->tok.ptr, p->tok.len) != NULL) {
       return vm_err(p->vm, "[%.*s] already declared", p->tok.len, p->tok.ptr);
     }
     pnext(p);
     if (p->tok.tok == '=') {
       pnext(p);
       TRY(parse_expr(p));
-      val = *vm_top(p->vm);
+      if (!p->noexec) val = *vm_top(p->vm);
     } else if (!p->noexec) {
       vm_push(p->vm, val);
     }
-    key = mk_str(p->vm, tmp.ptr, tmp.len);
-    TRY(key);
-    TRY(mjs_set(p->vm, obj, key, val));
+    if (!p->noexec) {
+      key = mk_str(p->vm, tmp.ptr, tmp.len);
+      TRY(key);
+      TRY(mjs_set(p->vm, obj, key, val));
+    }
     // LOG((DBGPREFIX "%s: sp %d, %d\n", __func__, p->vm->sp, p->tok.tok));
     if (p->tok.tok == ',') {
-      TRY(vm_drop(p->vm));
+      if (!p->noexec) TRY(vm_drop(p->vm));
       pnext(p);
     }
     if (p->tok.tok == ';' || p->tok.tok == TOK_EOF) break;
@@ -2107,8 +3295,7 @@ static val_t parse_return(struct parser *p) {
   } else {
     res = parse_expr(p);
   }
-  // Point parser to the end of func body, so that parse_block() gets '}'
-  if (!p->noexec) p->pos = p->end - 1;
+  if (!p->noexec) p->flow = FLOW_RETURN;
   return res;
 }
 
@@ -2120,139 +3307,1280 @@ static val_t parse_block_or_stmt(struct parser *p, int create_scope) {
   }
 }
 
+// Leave a loop: jump to the recorded end of its body, or skip the body if
+// the end is not known yet
+static val_t exit_loop(struct parser *p, const struct mark *body,
+                       const struct mark *end) {
+  if (end->pos != NULL) {
+    restore_mark(p, end);
+    return MJS_TRUE;
+  }
+  restore_mark(p, body);
+  return skip_statement(p);
+}
+
 static val_t parse_while(struct parser *p) {
   val_t res = MJS_TRUE;
-  struct parser tmp;
+  struct mark cond, body, end;
+  int seek = p->seek && !p->noexec;
+  memset(&body, 0, sizeof(body));
+  memset(&end, 0, sizeof(end));  // End of the body is not known yet
   pnext(p);
   EXPECT(p, '(');
   pnext(p);
-  tmp = *p;  // Remember the location of the condition expression
+  save_mark(p, &cond);  // Remember the location of the condition expression
+  p->loops++;
   for (;;) {
-    *p = tmp;  // On each iteration, re-evaluate the condition
-    TRY(parse_expr(p));
+    if (seek) {
+      // Resuming inside the loop body. The condition was evaluated before the
+      // script got suspended, skip it
+      p->noexec++;
+      TRY(parse_expr(p));
+      p->noexec--;
+      seek = 0;
+    } else {
+      restore_mark(p, &cond);  // On each iteration, re-evaluate the condition
+      TRY(parse_expr(p));
+    }
     EXPECT(p, ')');
     pnext(p);
-    if (is_true(p->vm, *vm_top(p->vm))) {
+    if (end.pos == NULL) save_mark(p, &body);
+    if (p->noexec || p->seek) {
+      // Not executing, just parse the body once
+    } else if (is_true(p->vm, *vm_top(p->vm))) {
       // Condition is true. Drop evaluated condition expression from the stack
-      if (!p->noexec) vm_drop(p->vm);
+      vm_drop(p->vm);
     } else {
-      // TODO(lsm): optimise here, p->pos = post_condition if it is saved
-      p->noexec++;
-      LOG((DBGPREFIX "%s: FALSE!!.., sp %d\n", __func__, p->vm->sp));
+      // Condition is false and becomes the value of the loop. Jump past the
+      // body, it has been recorded on the first iteration that completed
+      TRY(exit_loop(p, &body, &end));
+      break;
     }
     TRY(parse_block_or_stmt(p, 1));
     LOG((DBGPREFIX "%s: done.., sp %d\n", __func__, p->vm->sp));
-    if (p->noexec) break;
+    if (p->noexec || p->flow == FLOW_RETURN) break;
+    if (p->flow == FLOW_BREAK) {
+      p->flow = FLOW_NONE;  // Value of the body is the value of the loop
+      TRY(exit_loop(p, &body, &end));
+      break;
+    }
+    if (p->flow == FLOW_CONTINUE) {
+      p->flow = FLOW_NONE;
+    } else if (end.pos == NULL) {
+      save_mark(p, &end);
+    }
     vm_drop(p->vm);
     // vm_dump(p->vm);
+    TRY(count_step(p->vm));
+    if (can_suspend(p)) return suspend(p);  // Resume from the condition
   }
   LOG((DBGPREFIX "%s: out.., sp %d\n", __func__, p->vm->sp));
-  p->noexec = tmp.noexec;
+  p->loops--;
   return res;
 }
 
-static val_t parse_if(struct parser *p) {
+// Evaluate the condition of a for loop, an empty one being true
+static val_t parse_for_cond(struct parser *p, int *run) {
   val_t res = MJS_TRUE;
-  int saved_noexec = p->noexec, cond;
+  *run = 1;
+  if (p->tok.tok != ';') {
+    TRY(parse_expr(p));
+    if (!p->noexec) {
+      *run = is_true(p->vm, *vm_top(p->vm));
+      vm_drop(p->vm);
+    }
+  }
+  EXPECT(p, ';');
+  return res;
+}
+
+static val_t parse_for(struct parser *p) {
+  val_t res = MJS_TRUE;
+  struct mark cond, step, body, end;
+  int seek = p->seek && !p->noexec, run;
+  ind_t sp = p->vm->sp;
+  memset(&end, 0, sizeof(end));
   pnext(p);
   EXPECT(p, '(');
   pnext(p);
-  TRY(parse_expr(p));
+  // Variables declared by the initialiser get their own scope. When
+  // resuming, it has been left on the call stack
+  if (!p->noexec && !p->seek) TRY(create_scope(p->vm));
+  if (seek) p->noexec++;  // Resuming inside the body: skip the header
+  if (p->tok.tok == TOK_LET) {
+    TRY(parse_let(p));
+  } else if (p->tok.tok != ';') {
+    TRY(parse_expr(p));
+  }
+  while (!p->noexec && p->vm->sp > sp) vm_drop(p->vm);
+  EXPECT(p, ';');
+  pnext(p);
+  save_mark(p, &cond);
+  TRY(parse_for_cond(p, &run));
+  pnext(p);
+  save_mark(p, &step);  // Step is run after the body, skip it for now
+  while (p->tok.tok != ')') {
+    TRY(skip_binary(p, PREC_ASSIGN));
+    if (p->tok.tok != ',') break;
+    pnext(p);
+  }
   EXPECT(p, ')');
   pnext(p);
-  if (!p->noexec) {
-    cond = is_true(p->vm, *vm_top(p->vm));
-    vm_drop(p->vm);
-    if (!cond) {
-      vm_push(p->vm, MJS_UNDEFINED);
-      p->noexec++;
+  save_mark(p, &body);
+  if (seek) p->noexec--;
+  p->loops++;
+  while (run) {
+    TRY(parse_statement(p));
+    if (p->noexec || p->flow == FLOW_RETURN) break;
+    if (p->flow == FLOW_BREAK) break;  // Value of the body is that of the loop
+    if (p->flow == FLOW_CONTINUE) {
+      p->flow = FLOW_NONE;
+    } else if (end.pos == NULL) {
+      save_mark(p, &end);
     }
-  }
-  TRY(parse_block_or_stmt(p, 1));
-  p->noexec = saved_noexec;
-  return res;
-}
-
-static val_t parse_statement(struct parser *p) {
-  switch (p->tok.tok) {
-    case ';':
-      pnext(p);
-      return MJS_TRUE;
-    case TOK_LET:
-      return parse_let(p);
-    case '{': {
-      val_t res = parse_block(p, 1);
+    vm_drop(p->vm);
+    restore_mark(p, &step);
+    while (p->tok.tok != ')') {
+      TRY(parse_expr(p));
+      vm_drop(p->vm);
+      if (p->tok.tok != ',') break;
       pnext(p);
-      return res;
     }
-    case TOK_RETURN:
-      return parse_return(p);
-    case TOK_WHILE:
-      return parse_while(p);
-// clang-format off
-#if 0
-    case TOK_FOR: return parse_for(p);
-    case TOK_BREAK: pnext1(p); return MJS_SUCCESS;
-    case TOK_CONTINUE: pnext1(p); return MJS_SUCCESS;
-#endif
-    case TOK_IF: return parse_if(p);
-    case TOK_CASE: case TOK_CATCH: case TOK_DELETE: case TOK_DO:
-    case TOK_INSTANCEOF: case TOK_NEW: case TOK_SWITCH: case TOK_THROW:
-    case TOK_TRY: case TOK_VAR: case TOK_VOID: case TOK_WITH:
-      // clang-format on
-      return vm_err(p->vm, "[%.*s] not implemented", p->tok.len, p->tok.ptr);
-    default: {
-      val_t res = MJS_TRUE;
-      for (;;) {
-        TRY(parse_expr(p));
-        if (p->tok.tok != ',') break;
-        pnext(p);
-      }
+    restore_mark(p, &cond);
+    TRY(parse_for_cond(p, &run));
+    if (!run) TRY(vm_push(p->vm, MJS_UNDEFINED));  // Value of the loop
+    restore_mark(p, &body);
+    TRY(count_step(p->vm));
+    if (run && can_suspend(p)) {
+      res = suspend(p);  // Resume from the body
+      p->rs->path[p->rs->depth++] = (len_t)(p->tok.ptr - p->buf);
       return res;
     }
   }
+  p->loops--;
+  if (p->noexec) return res;
+  if (p->flow != FLOW_RETURN) {
+    if (p->vm->sp == sp) TRY(vm_push(p->vm, MJS_UNDEFINED));
+    p->flow = FLOW_NONE;
+    TRY(exit_loop(p, &body, &end));
+  }
+  return delete_scope(p->vm);
 }
 
-static val_t parse_statement_list(struct parser *p, tok_t endtok) {
+static val_t parse_do(struct parser *p) {
   val_t res = MJS_TRUE;
+  struct mark body, cond;
+  int run = 1;
+  cond.pos = NULL;
   pnext(p);
-  LOG((DBGPREFIX "%s: tok %d endtok %d\n", __func__, p->tok.tok, endtok));
-  while (res != MJS_ERROR && p->tok.tok != TOK_EOF && p->tok.tok != endtok) {
-    // Drop previous value from the stack
-    if (!p->noexec && p->vm->sp > 0) vm_drop(p->vm);
-    res = parse_statement(p);
-    while (p->tok.tok == ';') pnext(p);
+  save_mark(p, &body);
+  p->loops++;
+  for (;;) {
+    TRY(parse_statement(p));
+    if (p->flow == FLOW_RETURN) break;
+    if (p->flow == FLOW_BREAK) {
+      run = 0;  // Value of the body is the value of the loop
+    } else if (!p->noexec) {
+      vm_drop(p->vm);
+    }
+    if (p->flow == FLOW_NONE) {
+      while (p->tok.tok == ';') pnext(p);
+      if (cond.pos == NULL) save_mark(p, &cond);
+    } else if (cond.pos != NULL) {
+      restore_mark(p, &cond);  // Jump straight to the condition
+    } else {
+      restore_mark(p, &body);
+      TRY(skip_statement(p));
+      while (p->tok.tok == ';') pnext(p);
+      save_mark(p, &cond);
+    }
+    p->flow = FLOW_NONE;
+    EXPECT(p, TOK_WHILE);
+    pnext(p);
+    EXPECT(p, '(');
+    if (!run || p->noexec) {
+      TRY(skip_group(p));
+      break;
+    }
+    pnext(p);
+    TRY(parse_expr(p));
+    EXPECT(p, ')');
+    pnext(p);
+    if (!is_true(p->vm, *vm_top(p->vm))) break;  // Condition is the value
+    vm_drop(p->vm);
+    restore_mark(p, &body);
+    TRY(count_step(p->vm));
+    if (can_suspend(p)) return suspend(p);  // Resume from the body
   }
-  if (!p->noexec && p->vm->sp == 0) vm_push(p->vm, MJS_UNDEFINED);
+  p->loops--;
   return res;
 }
 
-/////////////////////////////// EXTERNAL API /////////////////////////////////
+static val_t parse_jump(struct parser *p) {
+  if (!p->noexec) {
+    if (p->loops == 0 && (p->tok.tok != TOK_BREAK || p->switches == 0)) {
+      return vm_err(p->vm, "[%.*s] outside of a loop", p->tok.len, p->tok.ptr);
+    }
+    p->flow = p->tok.tok == TOK_BREAK ? FLOW_BREAK : FLOW_CONTINUE;
+  }
+  pnext(p);
+  return MJS_TRUE;
+}
 
-static struct vm *mjs_create(void) {
-  struct vm *vm = (struct mjs *) calloc(1, sizeof(*vm));
+// Parse a case label value that is a number or a string literal followed by
+// ':', leaving the parser at the ':'. Otherwise, leave the parser intact and
+// return 0, the label is then evaluated as an expression
+static int case_literal(struct parser *p, struct tok *lit) {
+  struct mark m;
+  int neg = p->tok.tok == '-';
+  save_mark(p, &m);
+  if (neg) pnext(p);
+  *lit = p->tok;
+  if (neg) lit->num_value = -lit->num_value;
+  if ((lit->tok == TOK_NUM || (lit->tok == TOK_STR && !neg &&
+                               memchr(lit->ptr, '\\', lit->len) == NULL)) &&
+      pnext(p) == ':') {
+    return 1;
+  }
+  restore_mark(p, &m);
+  return 0;
+}
+
+static int case_match(struct vm *vm, val_t v, const struct tok *lit) {
+  len_t len;
+  const char *s;
+  if (lit->tok == TOK_NUM) {
+    return mjs_type(v) == MJS_TYPE_NUMBER && tof(v) == lit->num_value;
+  }
+  if (mjs_type(v) != MJS_TYPE_STRING) return 0;
+  s = mjs_to_str(vm, v, &len);
+  return len == lit->len && memcmp(s, lit->ptr, len) == 0;
+}
+
+#if MJS_SWITCH_CACHE_SIZE > 0
+// Table key of a case value: integers are taken as they are, strings are
+// hashed. Return 0 if the value cannot be a key
+static int case_key(const char *s, len_t len, mjs_num_t num, int is_num,
+                    uint32_t *key) {
+  uint32_t h = (uint32_t) len;
+  if (is_num) {
+    if (!(num >= -2147483648.0 && num <= 2147483647.0)) return 0;
+    *key = (uint32_t)(int32_t) num;
+    return (mjs_num_t)(int32_t) num == num;
+  }
+  while (len-- > 0) h = h * 31 + (uint8_t) *s++;
+  *key = h;
+  return 1;
+}
+
+static int val_key(struct vm *vm, val_t v, uint32_t *key) {
+  len_t len = 0;
+  const char *s = NULL;
+  if (mjs_type(v) == MJS_TYPE_STRING) s = mjs_to_str(vm, v, &len);
+  return (s != NULL || mjs_type(v) == MJS_TYPE_NUMBER) &&
+         case_key(s, len, s == NULL ? tof(v) : 0, s == NULL, key);
+}
+
+// Case table of a switch body, or NULL if there is no valid one
+static struct swtab *switch_table(struct vm *vm, const char *body) {
+  int i;
+  for (i = 0; i < MJS_SWITCH_CACHE_SIZE; i++) {
+    struct swtab *t = &vm->switches[i];
+    if (t->body == body && t->gen == code_gen(vm, body)) return t;
+  }
+  return NULL;
+}
+
+// Record a label into the table being built. Return 0 if it does not fit
+static int switch_add(struct swtab *t, const struct tok *lit, len_t off,
+                      uint16_t line) {
+  uint32_t key, i, n;
+  if (!case_key(lit->ptr, lit->len, lit->num_value, lit->tok == TOK_NUM,
+                &key)) {
+    return 0;
+  }
+  for (n = 0, i = key; n < MJS_SWITCH_CASES * 3 / 4; n++, i++) {
+    struct swcase *c = &t->cases[i & (MJS_SWITCH_CASES - 1)];
+    if (c->off == 0) {
+      c->key = key;
+      c->off = off;
+      c->line = line;
+      return 1;
+    }
+    if (c->key == key) return 0;  // Duplicate, or a clash of string hashes
+  }
+  return 0;
+}
+
+// Move the parser to a recorded label, lexing the token there
+static void jump_to(struct parser *p, const struct mark *body,
+                    const struct swcase *c) {
+  p->pos = body->tok.ptr + c->off;
+  p->line_no = body->line_no + c->line;
+  p->ahead_pos = NULL;
+  pnext(p);
+}
+
+// Look the discriminant up in a case table. The label it hits is lexed again
+// to tell a match from a clash of string hashes
+static void switch_lookup(struct parser *p, const struct mark *body,
+                          const struct swtab *t, val_t v) {
+  const struct swcase *c = t->dflt.off != 0 ? &t->dflt : &t->end;
+  struct tok lit;
+  uint32_t key, i;
+  if (val_key(p->vm, v, &key)) {
+    for (i = key;; i++) {
+      const struct swcase *e = &t->cases[i & (MJS_SWITCH_CASES - 1)];
+      if (e->off == 0) break;
+      if (e->key != key) continue;
+      jump_to(p, body, e);
+      if (case_literal(p, &lit) && case_match(p->vm, v, &lit)) return;
+      break;
+    }
+  }
+  jump_to(p, body, c);
+}
+#endif
+
+// Find where a switch starts running, given the discriminant on top of the
+// stack: the ':' of the first label that matches it, else of `default`,
+// else the closing '}'. Labels are tried in order, with the code between
+// them skipped. If all of them are literals, a case table is built on the
+// way, so that the next runs go straight to the label. When not executing,
+// only the table is built
+static val_t switch_dispatch(struct parser *p, const struct mark *body) {
+  val_t res = MJS_TRUE, v = p->noexec ? MJS_UNDEFINED : *vm_top(p->vm);
+  struct mark to, dflt;
+  struct tok lit;
+  int build = MJS_SWITCH_CACHE_SIZE > 0, match;
+#if MJS_SWITCH_CACHE_SIZE > 0
+  struct swtab *t = switch_table(p->vm, body->tok.ptr);
+  if (t != NULL) {
+    switch_lookup(p, body, t, v);
+    return res;
+  }
+  t = &p->vm->switches[p->vm->switch_next];
+  memset(t, 0, sizeof(*t));
+#else
+  (void) body;
+#endif
+  memset(&to, 0, sizeof(to));
+  memset(&dflt, 0, sizeof(dflt));
+  pnext(p);
+  while (p->tok.tok != '}') {
+    if (p->tok.tok == TOK_CASE) {
+#if MJS_SWITCH_CACHE_SIZE > 0
+      len_t off = (len_t)(p->pos - body->tok.ptr);
+      uint16_t line = (uint16_t)(p->line_no - body->line_no);
+#endif
+      pnext(p);
+      if (case_literal(p, &lit)) {
+        if (to.pos == NULL && case_match(p->vm, v, &lit)) save_mark(p, &to);
+#if MJS_SWITCH_CACHE_SIZE > 0
+        if (build) build = switch_add(t, &lit, off, line);
+#endif
+      } else if (to.pos != NULL || p->noexec) {
+        build = 0;  // Only literals go into the table
+        TRY(skip_binary(p, PREC_ASSIGN));
+        EXPECT(p, ':');
+      } else {
+        build = 0;
+        TRY(parse_binary(p, PREC_ASSIGN));
+        match = is_strict_equal(p->vm, vm_top(p->vm)[-1], *vm_top(p->vm));
+        vm_drop(p->vm);
+        v = *vm_top(p->vm);  // The string pool may have been compacted
+        EXPECT(p, ':');
+        if (match) save_mark(p, &to);
+      }
+      if ((to.pos != NULL || p->noexec) && !build) break;
+      pnext(p);
+    } else if (p->tok.tok == TOK_DEFAULT) {
+      pnext(p);
+      EXPECT(p, ':');
+      save_mark(p, &dflt);
+#if MJS_SWITCH_CACHE_SIZE > 0
+      t->dflt.off = (len_t)(p->tok.ptr - body->tok.ptr);
+      t->dflt.line = (uint16_t)(p->line_no - body->line_no);
+#endif
+      pnext(p);
+    } else if (p->tok.tok == TOK_EOF) {
+      return vm_err(p->vm, "unbalanced brackets");
+    } else {
+      TRY(skip_statement(p));
+      while (p->tok.tok == ';') pnext(p);
+    }
+  }
+#if MJS_SWITCH_CACHE_SIZE > 0
+  if (build) {
+    t->end.off = (len_t)(p->tok.ptr - body->tok.ptr);
+    t->end.line = (uint16_t)(p->line_no - body->line_no);
+    t->body = body->tok.ptr;
+    t->gen = code_gen(p->vm, t->body);
+    p->vm->switch_next =
+        (uint8_t)((p->vm->switch_next + 1) % MJS_SWITCH_CACHE_SIZE);
+  }
+#endif
+  if (to.pos != NULL) {
+    restore_mark(p, &to);
+  } else if (dflt.pos != NULL) {
+    restore_mark(p, &dflt);
+  }
+  return res;
+}
+
+// Leave a switch from the middle of its body, for the statement after it
+static val_t switch_exit(struct parser *p, const struct mark *body) {
+#if MJS_SWITCH_CACHE_SIZE > 0
+  struct swtab *t = switch_table(p->vm, body->tok.ptr);
+  if (t != NULL) {
+    jump_to(p, body, &t->end);
+    pnext(p);
+    return MJS_TRUE;
+  }
+#endif
+  restore_mark(p, body);
+  return skip_group(p);
+}
+
+static val_t parse_switch(struct parser *p) {
+  val_t res = MJS_TRUE;
+  struct mark body;
+  int seek = p->seek && !p->noexec;
+  pnext(p);
+  EXPECT(p, '(');
+  pnext(p);
+  if (seek) p->noexec++;  // Resuming inside the body: skip the discriminant
+  TRY(parse_expr(p));
+  if (seek) p->noexec--;
+  EXPECT(p, ')');
+  pnext(p);
+  EXPECT(p, '{');
+  save_mark(p, &body);
+#if MJS_SWITCH_CACHE_SIZE > 0
+  if (p->compile && p->noexec == 1) {
+    // Compiled scripts get their tables up front. Deeper switches are in
+    // function bodies, which run from a copy in the string pool
+    TRY(switch_dispatch(p, &body));
+    restore_mark(p, &body);
+  }
+#endif
+  // When resuming, the body scope has been left on the call stack
+  if (!p->noexec && !p->seek) {
+    TRY(switch_dispatch(p, &body));
+    vm_drop(p->vm);
+    TRY(create_scope(p->vm));
+  }
+  p->switches++;
+  if (p->tok.tok != '}') {
+    TRY(parse_statement_list(p, '}'));  // Labels on the way are passed
+  } else if (!p->noexec) {
+    TRY(vm_push(p->vm, MJS_UNDEFINED));  // No label matched
+  }
+  p->switches--;
+  if (p->flow == FLOW_BREAK) {
+    p->flow = FLOW_NONE;  // Value of the body is the value of the switch
+    TRY(switch_exit(p, &body));
+  } else if (p->flow == FLOW_NONE) {
+    EXPECT(p, '}');
+    pnext(p);
+  }
+  if (!p->noexec) TRY(delete_scope(p->vm));
+  return res;
+}
+
+// A label met while running a switch body is passed, the switch has already
+// picked where to start
+static val_t parse_label(struct parser *p) {
+  val_t res = MJS_TRUE;
+  tok_t tok = p->tok.tok;
+  if (p->switches == 0) {
+    return vm_err(p->vm, "[%.*s] outside of a switch", p->tok.len, p->tok.ptr);
+  }
+  pnext(p);
+  if (tok == TOK_CASE) TRY(skip_binary(p, PREC_ASSIGN));
+  EXPECT(p, ':');
+  pnext(p);
+  return res;
+}
+static val_t parse_if(struct parser *p) {
+  val_t res = MJS_TRUE;
+  int saved_noexec = p->noexec, cond;
+  pnext(p);
+  EXPECT(p, '(');
+  pnext(p);
+  if (p->seek && !p->noexec) {
+    // Resuming inside the body, the condition was true. Skip it
+    p->noexec++;
+    TRY(parse_expr(p));
+    p->noexec--;
+  } else {
+    TRY(parse_expr(p));
+  }
+  EXPECT(p, ')');
+  pnext(p);
+  if (!p->noexec && !p->seek) {
+    cond = is_true(p->vm, *vm_top(p->vm));
+    vm_drop(p->vm);
+    if (!cond) {
+      vm_push(p->vm, MJS_UNDEFINED);
+      if (p->tok.tok == '{' && jump_to_close(p)) {
+        pnext(p);
+        return res;
+      }
+      p->noexec++;
+    }
+  }
+  TRY(parse_block_or_stmt(p, 1));
+  p->noexec = saved_noexec;
+  return res;
+}
+
+static val_t parse_statement(struct parser *p) {
+  val_t res = MJS_TRUE;
+  const char *start = p->tok.ptr;
+#if MJS_PROFILE_SIZE > 0
+  struct prof_mark mark;
+  int profiled = !p->noexec;
+  if (profiled) prof_enter(p, &mark);
+#endif
+#if MJS_TRACE
+  if (!p->noexec) {
+    p->vm->line = (uint16_t)(p->line_no > 0xffff ? 0xffff : p->line_no);
+    TRACE(p->vm, MJS_TRACE_STMT, MJS_UNDEFINED);
+  }
+#endif
+  if (p->seek && !p->noexec) {
+    // Resuming: we must be at the next statement of the saved path
+    struct resume *rs = p->rs;
+    if (rs->pos >= rs->depth || p->buf + rs->path[rs->pos] != start) {
+      return vm_err(p->vm, "corrupt resume state");
+    }
+    if (++rs->pos >= rs->depth) p->seek = 0;  // Innermost, run it as usual
+  }
+  p->depth++;
+  switch (p->tok.tok) {
+    case ';':
+      pnext(p);
+      break;
+    case TOK_LET:
+      res = parse_let(p);
+      break;
+    case '{':
+      res = parse_block(p, 1);
+      pnext(p);
+      break;
+    case TOK_RETURN:
+      res = parse_return(p);
+      break;
+    case TOK_WHILE:
+      res = parse_while(p);
+      break;
+// clang-format off
+    case TOK_FOR: res = parse_for(p); break;
+    case TOK_DO: res = parse_do(p); break;
+    case TOK_BREAK: case TOK_CONTINUE: res = parse_jump(p); break;
+    case TOK_IF: res = parse_if(p); break;
+    case TOK_SWITCH: res = parse_switch(p); break;
+    case TOK_CASE: case TOK_DEFAULT: res = parse_label(p); break;
+    case TOK_CATCH: case TOK_DELETE:
+    case TOK_INSTANCEOF: case TOK_NEW: case TOK_THROW:
+    case TOK_TRY: case TOK_VAR: case TOK_VOID: case TOK_WITH:
+      // clang-format on
+      res = vm_err(p->vm, "[%.*s] not implemented", p->tok.len, p->tok.ptr);
+      break;
+    default:
+      for (;;) {
+        res = parse_expr(p);
+        if (res == MJS_ERROR || p->tok.tok != ',') break;
+        pnext(p);
+      }
+      break;
+  }
+  p->depth--;
+#if MJS_PROFILE_SIZE > 0
+  if (profiled) prof_leave(p->vm, &mark);
+#endif
+  // Script is being suspended: record statements we're in, innermost first
+  if (res == MJS_ERROR && p->vm->suspended && p->rs != NULL) {
+    p->rs->path[p->rs->depth++] = (len_t)(start - p->buf);
+  }
+  return res;
+}
+
+static val_t parse_statement_list(struct parser *p, tok_t endtok) {
+  val_t res = MJS_TRUE;
+  ind_t sp = p->vm->sp;  // Values below belong to the caller
+  pnext(p);
+  LOG((DBGPREFIX "%s: tok %d endtok %d\n", __func__, p->tok.tok, endtok));
+  while (res != MJS_ERROR && p->tok.tok != TOK_EOF && p->tok.tok != endtok &&
+         p->flow == FLOW_NONE) {
+    // Drop previous value from the stack
+    if (!p->noexec && p->vm->sp > sp) vm_drop(p->vm);
+    if (p->seek && !p->noexec &&
+        p->tok.ptr < p->buf + p->rs->path[p->rs->pos]) {
+      // Resuming: skip statements that precede the saved one
+      p->noexec++;
+      res = parse_statement(p);
+      p->noexec--;
+      while (p->tok.tok == ';') pnext(p);
+      continue;
+    }
+    if (!p->noexec) {
+      if (!p->seek && can_suspend(p)) {
+        res = suspend(p);  // Resume from this statement
+        p->rs->path[p->rs->depth++] = (len_t)(p->tok.ptr - p->buf);
+        break;
+      }
+      if ((res = count_step(p->vm)) == MJS_ERROR) break;
+    }
+    res = parse_statement(p);
+    while (p->tok.tok == ';') pnext(p);
+  }
+  if (!p->noexec && p->vm->sp == sp) vm_push(p->vm, MJS_UNDEFINED);
+  return res;
+}
+
+////////////////////////////////// TIMERS ////////////////////////////////////
+#if MJS_TIMER_POOL_SIZE > 0
+static val_t mjs_mk_c_func(struct vm *vm, cfn_t fn, const char *decl);
+
+// Timers are kept in a hashed timing wheel: every wheel slot holds a list of
+// timers that expire on a tick congruent to the slot number. Each tick of
+// mjs_poll() visits one slot, checking only timers that may be due.
+// A timer is linked to the first tick that starts at or after its expiration.
+// Ticks are counted from the last processed one, so the host clock may wrap
+static void timer_link(struct vm *vm, ind_t i) {
+  struct timer *t = &vm->timers[i];
+  int32_t ms = (int32_t)(t->expire - vm->tick_ms);
+  uint32_t tick = vm->ticks + 1;  // Overdue timers go to the next slot
+  if (ms > 0) {
+    tick = vm->ticks +
+           ((uint32_t) ms + MJS_TIMER_TICK_MS - 1) / MJS_TIMER_TICK_MS;
+  }
+  t->slot = (uint8_t)(tick & (MJS_TIMER_WHEEL_SIZE - 1));
+  t->next = vm->wheel[t->slot];
+  t->flags |= TIMER_LINKED;
+  vm->wheel[t->slot] = i;
+}
+
+static void timer_unlink(struct vm *vm, ind_t i) {
+  ind_t *p = &vm->wheel[vm->timers[i].slot];
+  while (*p != INVALID_INDEX && *p != i) p = &vm->timers[*p].next;
+  if (*p == i) *p = vm->timers[i].next;
+  vm->timers[i].flags &= (uint8_t) ~TIMER_LINKED;
+}
+
+static int add_timer(struct vm *vm, val_t fn, int ms, uint32_t period) {
+  ind_t i;
+  if (mjs_type(fn) != MJS_TYPE_FUNCTION) return 0;
+  for (i = 0; i < ARRSIZE(vm->timers); i++) {
+    struct timer *t = &vm->timers[i];
+    if (t->fn != MJS_UNDEFINED || t->flags != 0) continue;
+    t->fn = fn;
+    t->expire = vm->now + (uint32_t)(ms < 0 ? 0 : ms);
+    t->period = period;
+    timer_link(vm, i);
+    return i + 1;  // Timer ID. 0 is never a valid ID
+  }
+  return 0;
+}
+
+static int js_set_timeout(struct vm *vm, val_t fn, int ms) {
+  return add_timer(vm, fn, ms, 0);
+}
+
+static int js_set_interval(struct vm *vm, val_t fn, int ms) {
+  uint32_t period = ms < MJS_TIMER_TICK_MS ? MJS_TIMER_TICK_MS : (uint32_t) ms;
+  return add_timer(vm, fn, ms, period);
+}
+
+static int js_clear_timeout(struct vm *vm, int id) {
+  ind_t i = (ind_t)(id - 1);
+  if (id <= 0 || i >= ARRSIZE(vm->timers)) return 0;
+  if (vm->timers[i].flags & TIMER_LINKED) timer_unlink(vm, i);
+  vm->timers[i].fn = MJS_UNDEFINED;  // Running timer is freed by mjs_poll()
+  return id;
+}
+
+static void init_timers(struct vm *vm) {
+  val_t v, global = mjs_get_global(vm);
+  ind_t i;
+  for (i = 0; i < ARRSIZE(vm->timers); i++) vm->timers[i].fn = MJS_UNDEFINED;
+  for (i = 0; i < ARRSIZE(vm->wheel); i++) vm->wheel[i] = INVALID_INDEX;
+  mjs_ffi(vm, "setTimeout", (cfn_t) js_set_timeout, "imji");
+  mjs_ffi(vm, "setInterval", (cfn_t) js_set_interval, "imji");
+  v = mjs_mk_c_func(vm, (cfn_t) js_clear_timeout, "imi");
+  mjs_set(vm, global, mjs_mk_str(vm, "clearTimeout", -1), v);
+  mjs_set(vm, global, mjs_mk_str(vm, "clearInterval", -1), v);
+}
+#endif
+
+/////////////////////////////////// TASKS ////////////////////////////////////
+#if MJS_TASK_POOL_SIZE > 0
+static val_t run_script(struct vm *vm, struct parser *p);
+
+// sleep() and yield() take effect at the end of the statement of the task
+// that calls them, even if they're called from a function. Outside of tasks,
+// they do nothing
+static void js_sleep(struct vm *vm, int ms) {
+  if (vm->task == 0) return;
+  vm->tasks[vm->task - 1].wake = vm->now + (uint32_t)(ms < 0 ? 0 : ms);
+  vm->yield = 1;
+}
+
+static void js_yield(struct vm *vm) { js_sleep(vm, 0); }
+
+// Run task until it sleeps, yields, ends or fails
+static val_t run_task(struct vm *vm, ind_t i) {
+  struct task *t = &vm->tasks[i];
+  struct parser p = mk_parser(vm, t->rs.buf, (int) t->rs.len);
+  val_t res;
+  TRY(restore_scopes(vm, &t->rs));
+  p.rs = &t->rs;
+  p.seek = t->rs.depth > 0;
+  t->rs.pos = 0;
+  vm->task = (ind_t)(i + 1);
+  res = run_script(vm, &p);
+  vm->task = 0;
+  vm->yield = 0;
+  if (res == MJS_SUSPENDED) return MJS_TRUE;
+  t->rs.buf = NULL;  // Task is over, free the slot
+  return res == MJS_ERROR ? res : MJS_TRUE;
+}
+
+static val_t run_tasks(struct vm *vm) {
+  ind_t i;
+  for (i = 0; i < ARRSIZE(vm->tasks); i++) {
+    struct task *t = &vm->tasks[i];
+    if (t->rs.buf == NULL || (int32_t)(t->wake - vm->now) > 0) continue;
+    LOG((DBGPREFIX "%s: task %d at %lu\n", __func__, i, (unsigned long) vm->now));
+    if (run_task(vm, i) == MJS_ERROR) return MJS_ERROR;  // Keep the message
+  }
+  return MJS_TRUE;
+}
+
+static void init_tasks(struct vm *vm) {
+  mjs_ffi(vm, "sleep", (cfn_t) js_sleep, "vmi");
+  mjs_ffi(vm, "yield", (cfn_t) js_yield, "vm");
+}
+#endif
+
+/////////////////////////////// EXTERNAL API /////////////////////////////////
+
+static const struct mjs_config s_default_config = {
+    MJS_DATA_STACK_SIZE, MJS_CALL_STACK_SIZE,  MJS_OBJ_POOL_SIZE,
+    MJS_PROP_POOL_SIZE,  MJS_CFUNC_POOL_SIZE,  MJS_STRING_POOL_SIZE};
+
+#define MJS_ALIGN(n) (((n) + 7) & ~(size_t) 7)  // Pools are 8-byte aligned
+
+// Return the size of memory needed for a VM with pools sized by `cfg`.
+// NULL `cfg` stands for the compile-time MJS_*_SIZE defaults
+static size_t mjs_arena_size(const struct mjs_config *cfg) {
+  if (cfg == NULL) cfg = &s_default_config;
+  return 7 + MJS_ALIGN(sizeof(struct vm)) +
+         MJS_ALIGN(cfg->cfunc_pool_size * sizeof(struct cfunc)) +
+         MJS_ALIGN(cfg->prop_pool_size * sizeof(val_t)) * 2 +
+         MJS_ALIGN(cfg->prop_pool_size * sizeof(ind_t)) +
+         MJS_ALIGN(cfg->prop_pool_size) +
+         MJS_ALIGN(cfg->data_stack_size * sizeof(val_t)) +
+         MJS_ALIGN(cfg->call_stack_size * sizeof(val_t)) +
+         MJS_ALIGN(cfg->obj_pool_size * sizeof(struct obj)) +
+         MJS_ALIGN(cfg->string_pool_size);
+}
+
+static void *carve(uint8_t **p, size_t size) {
+  void *ptr = *p;
+  *p += MJS_ALIGN(size);
+  return ptr;
+}
+
+// Create VM inside of the caller-provided memory block, which must stay
+// valid until the VM is no longer used. No other memory is allocated.
+// Return NULL if the block is smaller than mjs_arena_size(cfg)
+static struct vm *mjs_create_in(void *mem, size_t size,
+                                const struct mjs_config *cfg) {
+  uint8_t *p = (uint8_t *) (((uintptr_t) mem + 7) & ~(uintptr_t) 7);
+  struct vm *vm;
+  ind_t i;
+  if (cfg == NULL) cfg = &s_default_config;
+  if (mem == NULL || size < mjs_arena_size(cfg) || cfg->obj_pool_size == 0 ||
+      cfg->data_stack_size == 0 || cfg->call_stack_size < 2 ||
+      cfg->obj_pool_size == INVALID_INDEX ||
+      cfg->prop_pool_size == INVALID_INDEX) {
+    return NULL;
+  }
+  memset(mem, 0, size);
+  vm = (struct vm *) carve(&p, sizeof(*vm));
+  vm->cfg = *cfg;
+  vm->cfuncs = (struct cfunc *) carve(
+      &p, cfg->cfunc_pool_size * sizeof(struct cfunc));
+  vm->prop_keys = (val_t *) carve(&p, cfg->prop_pool_size * sizeof(val_t));
+  vm->prop_vals = (val_t *) carve(&p, cfg->prop_pool_size * sizeof(val_t));
+  vm->data_stack = (val_t *) carve(&p, cfg->data_stack_size * sizeof(val_t));
+  vm->call_stack = (val_t *) carve(&p, cfg->call_stack_size * sizeof(val_t));
+  vm->objs = (struct obj *) carve(&p, cfg->obj_pool_size * sizeof(struct obj));
+  vm->prop_next = (ind_t *) carve(&p, cfg->prop_pool_size * sizeof(ind_t));
+  vm->prop_tags = (uint8_t *) carve(&p, cfg->prop_pool_size);
+  vm->stringbuf = (uint8_t *) carve(&p, cfg->string_pool_size);
+  vm->free_obj = vm->free_prop = INVALID_INDEX;
+  for (i = cfg->obj_pool_size; i-- > 1;) free_obj(vm, i);  // 0 is global
+  for (i = cfg->prop_pool_size; i-- > 0;) free_prop(vm, i);
   vm->objs[0].flags = OBJ_ALLOCATED;
   vm->objs[0].props = INVALID_INDEX;
   vm->call_stack[0] = MK_VAL(MJS_TYPE_OBJECT, 0);
   vm->csp++;
-  LOG((DBGPREFIX "%s: size %d bytes\n", __func__, (int) sizeof(*vm)));
+  vm->stats.objs = vm->stats.objs_peak = 1;
+  vm->stats.call_stack_peak = 1;
+#if MJS_TIMER_POOL_SIZE > 0
+  init_timers(vm);
+#endif
+#if MJS_TASK_POOL_SIZE > 0
+  init_tasks(vm);
+#endif
+  mjs_profile_reset(vm);
+  LOG((DBGPREFIX "%s: size %d bytes\n", __func__, (int) size));
   return vm;
-};
+}
 
-static void mjs_destroy(struct vm *vm) { free(vm); }
+static unsigned long mjs_size(void) {
+  return (unsigned long) mjs_arena_size(NULL);
+}
 
-static val_t mjs_eval(struct vm *vm, const char *buf, int len) {
-  struct parser p = mk_parser(vm, buf, len > 0 ? len : (int) strlen(buf));
+static struct vm *mjs_create(void) {
+  size_t size = mjs_arena_size(NULL);
+  uint8_t *mem = (uint8_t *) malloc(size);
+  struct vm *vm = mjs_create_in(mem, size, NULL);
+  if (vm != NULL) {
+    vm->mem = mem;
+  } else {
+    free(mem);
+  }
+  return vm;
+}
+
+static void mjs_destroy(struct vm *vm) {
+  if (vm != NULL) free(vm->mem);  // VMs created by mjs_create_in() own none
+}
+
+// Execute script until it ends, fails, or runs out of budget
+static val_t run_script(struct vm *vm, struct parser *p) {
   val_t v = MJS_ERROR;
+  ind_t sp, csp = p->rs != NULL ? p->rs->csp : vm->csp;
+  if (vm->nesting == 0) {
+    while (vm->sp > 0) vm_drop(vm);  // Drop the result of the previous run
+    vm->steps = 0;                   // Nested scripts share the slice
+  }
+  sp = vm->sp;
+  vm->nesting++;
   vm->error_message[0] = '\0';
-  if (parse_statement_list(&p, TOK_EOF) != MJS_ERROR && vm->sp == 1) {
+  if (parse_statement_list(p, TOK_EOF) != MJS_ERROR && vm->sp == sp + 1) {
     v = *vm_top(vm);
   }
+  vm->nesting--;
+  if (vm->suspended) {
+    struct resume *rs = p->rs;
+    ind_t i;
+    for (i = 0; i < rs->depth / 2; i++) {  // Make path outermost first
+      len_t tmp = rs->path[i];
+      rs->path[i] = rs->path[rs->depth - i - 1];
+      rs->path[rs->depth - i - 1] = tmp;
+    }
+    vm->suspended = 0;
+    save_scopes(vm, rs);
+    LOG((DBGPREFIX "%s: suspended, depth %d\n", __func__, rs->depth));
+    return MJS_SUSPENDED;
+  }
+  if (p->rs != NULL) p->rs->buf = NULL;
+#if MJS_CODE_CACHES
+  // The script is over, and the host may free its buffer, or reuse it for
+  // other code if it is in the string pool. Drop caches that point into it.
+  // Compiled scripts keep theirs until mjs_release()
+  if (script_of(vm, p->buf) == NULL) {
+    vm->run_gen++;
+    if (in_pool(vm, p->buf)) vm->code_gen++;
+  }
+#endif
+  if (v == MJS_ERROR) {
+    while (vm->csp > csp) delete_scope(vm);  // Drop scopes of failed blocks
+  }
   vm_dump(vm);
   LOG((DBGPREFIX "%s: %s\n", __func__, tostr(vm, *vm_top(vm))));
   return v;
 }
 
+// If the execution budget is set, the script gets suspended when it runs
+// out of budget, and mjs_eval() returns MJS_SUSPENDED. Script buffer must
+// stay intact until mjs_resume() completes it.
+static val_t mjs_eval(struct vm *vm, const char *buf, int len) {
+  struct parser p = mk_parser(vm, buf, len > 0 ? len : (int) strlen(buf));
+  struct resume *rs = &vm->resume;
+#if MJS_HISTOGRAM_BUCKETS > 0
+  uint32_t start = hist_start(vm);
+  val_t res;
+#endif
+  if (vm->nesting == 0 && rs->buf == NULL) {
+    // Only one script at a time can be suspended. Nested scripts, e.g.
+    // evaluated by FFI functions, run to completion
+    p.rs = rs;
+    rs->buf = p.buf;
+    rs->len = (len_t)(p.end - p.buf);
+    rs->depth = 0;
+    rs->csp = vm->csp;
+    rs->nscopes = 0;
+  }
+#if MJS_HISTOGRAM_BUCKETS > 0
+  res = run_script(vm, &p);
+  hist_add(vm, MJS_HIST_EVAL, start);
+  return res;
+#else
+  return run_script(vm, &p);
+#endif
+}
+
+static void mjs_set_budget(struct vm *vm, int steps) { vm->budget = steps; }
+
+// Current usage is read off the VM, the rest is counted as it goes
+static void mjs_stats(struct vm *vm, struct mjs_stats *stats) {
+  *stats = vm->stats;
+  stats->cfuncs = vm->cfuncs_len;
+  stats->strings = vm->stringbuf_len;
+  stats->stack = vm->sp;
+  stats->call_stack = vm->csp;
+}
+
+static void mjs_set_clock(struct vm *vm, uint32_t (*fn)(void)) {
+  vm->clock = fn;
+}
+
+static void mjs_profile_reset(struct vm *vm) {
+#if MJS_PROFILE_SIZE > 0
+  memset(vm->prof, 0, sizeof(vm->prof));
+  memset(vm->prof_funcs, 0, sizeof(vm->prof_funcs));
+  strcpy(vm->prof_funcs[0], "(script)");
+  strcpy(vm->prof_funcs[MJS_PROFILE_FUNCS - 1], "(other)");
+  vm->prof_frame = vm->prof_cur = INVALID_INDEX;
+  vm->prof_func = 0;
+  vm->prof_child = vm->prof_lost = 0;
+#else
+  (void) vm;
+#endif
+}
+
+// Flat profile has a line per function and line, with executions and self
+// time, summed up over all call stacks. Collapsed stacks have a line per
+// call stack, weighted by time if a clock is set, by executions otherwise
+static void mjs_profile_dump(struct vm *vm, int collapsed,
+                             void (*out)(const char *line, void *ctx),
+                             void *ctx) {
+#if MJS_PROFILE_SIZE > 0
+  char buf[256];
+  ind_t i, j;
+  if (!collapsed) out("function          line      count       time\n", ctx);
+  for (i = 0; i < MJS_PROFILE_SIZE; i++) {
+    struct prof *e = &vm->prof[i];
+    unsigned long count = 0, time = 0;
+    if (!e->used || e->count == 0) continue;
+    if (collapsed) {
+      int n = prof_stack(vm, i, buf, (int) sizeof(buf) - 16);
+      snprintf(buf + n, sizeof(buf) - n, " %lu\n",
+               (unsigned long) (vm->clock != NULL ? e->time : e->count));
+      out(buf, ctx);
+      continue;
+    }
+    for (j = 0; j < i; j++) {
+      struct prof *e2 = &vm->prof[j];
+      if (e2->used && e2->func == e->func && e2->line == e->line) break;
+    }
+    if (j < i) continue;  // This line is already printed
+    for (j = i; j < MJS_PROFILE_SIZE; j++) {
+      struct prof *e2 = &vm->prof[j];
+      if (!e2->used || e2->func != e->func || e2->line != e->line) continue;
+      count += e2->count;
+      time += e2->time;
+    }
+    snprintf(buf, sizeof(buf), "%-16s %5d %10lu %10lu\n",
+             vm->prof_funcs[e->func], (int) e->line, count, time);
+    out(buf, ctx);
+  }
+  if (vm->prof_lost > 0 && !collapsed) {
+    snprintf(buf, sizeof(buf), "%lu statements did not fit\n",
+             (unsigned long) vm->prof_lost);
+    out(buf, ctx);
+  }
+#else
+  (void) vm, (void) collapsed, (void) out, (void) ctx;
+#endif
+}
+
+#if MJS_HISTOGRAM_BUCKETS > 0
+static const struct mjs_histogram *mjs_histogram(struct vm *vm, int kind) {
+  return kind >= 0 && kind < MJS_HIST_MAX ? &vm->hist[kind] : NULL;
+}
+
+static void mjs_histogram_reset(struct vm *vm) {
+  memset(vm->hist, 0, sizeof(vm->hist));
+}
+#endif
+
+#if MJS_TRACE
+// Trace into `buf`, which must hold the header and at least one event.
+// A NULL `buf` stops tracing
+static void mjs_set_trace(struct vm *vm, void *buf, size_t size) {
+  struct mjs_trace_hdr *h = (struct mjs_trace_hdr *) buf;
+  vm->trace = NULL;
+  if (h == NULL || size < sizeof(*h) + sizeof(struct mjs_trace_event)) return;
+  h->magic = MJS_TRACE_MAGIC;
+  h->size = (uint32_t)((size - sizeof(*h)) / sizeof(struct mjs_trace_event));
+  h->head = 0;
+  vm->trace = h;
+}
+#endif
+
+static void walk_root(struct vm *vm, val_t v, mjs_walk_cb_t cb, void *ctx) {
+  struct mjs_heap_item it;
+  memset(&it, 0, sizeof(it));
+  it.kind = MJS_HEAP_ROOT;
+  it.value = v;
+  cb(vm, &it, ctx);
+}
+
+// Report roots first: values held by the stacks, timers and sleeping tasks.
+// Anything that cannot be reached from them through props is leaked
+static void mjs_heap_walk(struct vm *vm, mjs_walk_cb_t cb, void *ctx) {
+  struct mjs_heap_item it;
+  ind_t i, j;
+  for (i = 0; i < vm->csp; i++) walk_root(vm, vm->call_stack[i], cb, ctx);
+  for (i = 0; i < vm->sp; i++) walk_root(vm, vm->data_stack[i], cb, ctx);
+#if MJS_TIMER_POOL_SIZE > 0
+  for (i = 0; i < ARRSIZE(vm->timers); i++) {
+    val_t fn = vm->timers[i].fn;
+    if (fn != MJS_UNDEFINED) walk_root(vm, fn, cb, ctx);
+  }
+#endif
+  for (j = 0; vm->resume.buf != NULL && j < vm->resume.nscopes; j++) {
+    walk_root(vm, vm->resume.scopes[j], cb, ctx);
+  }
+#if MJS_TASK_POOL_SIZE > 0
+  for (i = 0; i < ARRSIZE(vm->tasks); i++) {
+    for (j = 0; vm->tasks[i].rs.buf != NULL && j < vm->tasks[i].rs.nscopes;
+         j++) {
+      walk_root(vm, vm->tasks[i].rs.scopes[j], cb, ctx);
+    }
+  }
+#endif
+  memset(&it, 0, sizeof(it));
+  for (i = 0; i < vm->cfg.obj_pool_size; i++) {
+    if (vm->objs[i].flags == 0) continue;
+    it.kind = MJS_HEAP_OBJ;
+    it.id = i;
+    it.size = sizeof(struct obj);
+    it.value = it.owner = MK_VAL(MJS_TYPE_OBJECT, i);
+    it.key = MJS_UNDEFINED;
+    cb(vm, &it, ctx);
+    for (j = vm->objs[i].props; j != INVALID_INDEX; j = vm->prop_next[j]) {
+      it.kind = MJS_HEAP_PROP;
+      it.id = j;
+      it.size = 2 * sizeof(val_t) + sizeof(ind_t) + 1;
+      it.key = vm->prop_keys[j];
+      it.value = vm->prop_vals[j];
+      cb(vm, &it, ctx);
+    }
+  }
+  it.key = it.owner = MJS_UNDEFINED;
+  for (i = 0; i < vm->stringbuf_len; i = (ind_t)(i + it.size)) {
+    it.kind = MJS_HEAP_STRING;  // Function code is reported as a string too
+    it.id = i;
+    it.size = (unsigned long) vm->stringbuf[i] + 2;
+    it.value = MK_VAL(MJS_TYPE_STRING, i);
+    cb(vm, &it, ctx);
+  }
+  for (i = 0; i < vm->cfuncs_len; i++) {
+    it.kind = MJS_HEAP_CFUNC;
+    it.id = i;
+    it.size = sizeof(struct cfunc);
+    it.value = MK_VAL(MJS_TYPE_C_FUNCTION, i);
+    cb(vm, &it, ctx);
+  }
+}
+
+static val_t mjs_resume(struct vm *vm) {
+  struct resume *rs = &vm->resume;
+  struct parser p;
+  if (rs->buf == NULL || vm->nesting > 0) {
+    return vm_err(vm, "nothing to resume");
+  }
+  if (restore_scopes(vm, rs) == MJS_ERROR) return MJS_ERROR;
+  p = mk_parser(vm, rs->buf, (int) rs->len);
+  p.rs = rs;
+  p.seek = 1;
+  rs->pos = 0;
+  return run_script(vm, &p);
+}
+
+// Start a task, which first runs on the next mjs_poll(). The script buffer
+// must stay intact until the task ends. Return task handle, or -1 on error
+static int mjs_spawn(struct vm *vm, const char *buf, int len) {
+#if MJS_TASK_POOL_SIZE > 0
+  ind_t i;
+  for (i = 0; i < ARRSIZE(vm->tasks); i++) {
+    struct task *t = &vm->tasks[i];
+    if (t->rs.buf != NULL) continue;
+    memset(t, 0, sizeof(*t));
+    t->rs.buf = buf;
+    t->rs.len = (len_t)(len > 0 ? len : (int) strlen(buf));
+    t->wake = vm->now;
+    return i;
+  }
+  vm_err(vm, "task OOM");
+#else
+  (void) buf;
+  (void) len;
+  vm_err(vm, "tasks disabled");
+#endif
+  return -1;
+}
+
+// Free a compiled script handle and the code caches built for it. After
+// that, the script buffer may be freed
+static void mjs_release(struct vm *vm, int script) {
+  struct script *s;
+  if (script < 0 || script >= (int) ARRSIZE(vm->scripts)) return;
+  s = &vm->scripts[script];
+  if (s->buf == NULL) return;
+#if MJS_CODE_CACHES
+  forget_code(vm, s->buf, s->len);
+#endif
+#if MJS_SKIP_INDEX_SIZE > 0
+  unpin_group_index(vm, s);
+#endif
+  s->buf = NULL;
+  s->len = 0;
+}
+
+// Parse the whole script without executing it, and remember it for mjs_run().
+// The code caches of the script, its skip index and the case tables of its
+// switch statements, are built here and kept across runs. The script buffer
+// must stay intact until the handle is given to mjs_release().
+// Return script handle, or -1 on error, with error message set.
+static int mjs_compile(struct vm *vm, const char *buf, int len) {
+  struct parser p = mk_parser(vm, buf, len > 0 ? len : (int) strlen(buf));
+  struct script *s;
+  int i;
+  vm->error_message[0] = '\0';
+  for (i = 0; i < (int) ARRSIZE(vm->scripts); i++) {
+    if (vm->scripts[i].buf == NULL) break;
+  }
+  if (i >= (int) ARRSIZE(vm->scripts)) {
+    vm_err(vm, "script OOM");
+    return -1;
+  }
+  s = &vm->scripts[i];
+  s->buf = p.buf;
+  s->len = (len_t)(p.end - p.buf);
+#if MJS_CODE_CACHES
+  forget_code(vm, s->buf, s->len);  // Left by a script that ran from here
+#endif
+  p.noexec++;
+  p.compile = 1;
+  if (parse_statement_list(&p, TOK_EOF) == MJS_ERROR) {
+    size_t n = strlen(vm->error_message);
+    snprintf(vm->error_message + n, sizeof(vm->error_message) - n,
+             " at line %d", p.line_no);
+#if MJS_CODE_CACHES
+    forget_code(vm, s->buf, s->len);
+#endif
+    s->buf = NULL;
+    return -1;
+  }
+#if MJS_SKIP_INDEX_SIZE > 0
+  pin_group_index(vm, s);
+#endif
+  LOG((DBGPREFIX "%s: script %d, %d bytes\n", __func__, i, s->len));
+  return i;
+}
+
+static val_t mjs_run(struct vm *vm, int script) {
+  if (script < 0 || script >= (int) ARRSIZE(vm->scripts) ||
+      vm->scripts[script].buf == NULL) {
+    return vm_err(vm, "bad script %d", script);
+  }
+  return mjs_eval(vm, vm->scripts[script].buf, (int) vm->scripts[script].len);
+}
+
+static val_t mjs_call(struct vm *vm, val_t fn, int argc, const val_t *argv,
+                      val_t *result) {
+  val_t res = MJS_TRUE;
+  // Like with mjs_eval(), the result stays on the stack so that it is not
+  // released. A top level call replaces the result of the previous run
+  ind_t saved_sp = vm->sp, base = vm->nesting == 0 ? 0 : vm->sp;
+  if (mjs_type(fn) != MJS_TYPE_FUNCTION) return vm_err(vm, "calling non-func");
+  TRY(vm_push(vm, fn));
+  if (vm->nesting == 0) vm->steps = 0;  // Host call starts a new slice
+  vm->nesting++;
+  res = call_js(vm, fn, argc, argv, 0);
+  vm->nesting--;
+  if (res == MJS_ERROR || result == NULL || vm->sp <= saved_sp) {
+    while (vm->sp > saved_sp) vm_drop(vm);
+  } else {
+    val_t v = *result = *vm_top(vm);
+    while (vm->sp > base + 1) {  // Drop what is below, keep v on top
+      vm->data_stack[vm->sp - 1] = vm->data_stack[vm->sp - 2];
+      vm->data_stack[vm->sp - 2] = v;
+      vm_drop(vm);
+    }
+  }
+  return res == MJS_ERROR ? res : MJS_TRUE;
+}
+
+// Call expired timer callbacks, then run tasks that are due. `now_ms` is a
+// monotonic host time, e.g. millis(). Timers and sleep() are relative to the
+// `now_ms` of the last call.
+static val_t mjs_poll(struct vm *vm, uint32_t now_ms) {
+  val_t res = MJS_TRUE;
+#if MJS_TIMER_POOL_SIZE > 0
+  // Unsigned difference survives the wrap of the host clock. A clock that
+  // goes back looks like a big step forward, which just resyncs the wheel
+  uint32_t n = (now_ms - vm->tick_ms) / MJS_TIMER_TICK_MS;
+  if (n > MJS_TIMER_WHEEL_SIZE) {  // Visit slots once
+    vm->ticks += n - MJS_TIMER_WHEEL_SIZE;
+    vm->tick_ms += (n - MJS_TIMER_WHEEL_SIZE) * MJS_TIMER_TICK_MS;
+    n = MJS_TIMER_WHEEL_SIZE;
+  }
+#endif
+  vm->now = now_ms;
+#if MJS_TIMER_POOL_SIZE > 0
+  while (n-- > 0) {
+    ind_t i, *head = &vm->wheel[++vm->ticks & (MJS_TIMER_WHEEL_SIZE - 1)];
+    ind_t *p = head;
+    vm->tick_ms += MJS_TIMER_TICK_MS;
+    while ((i = *p) != INVALID_INDEX) {
+      struct timer *t = &vm->timers[i];
+      if ((int32_t)(t->expire - now_ms) > 0) {
+        p = &t->next;  // Not due yet, leave for one of the next rounds
+        continue;
+      }
+      *p = t->next;
+      t->flags = TIMER_RUNNING;
+      LOG((DBGPREFIX "%s: timer %d at %lu\n", __func__, i, (unsigned long) now_ms));
+      if (mjs_call(vm, t->fn, 0, NULL, NULL) == MJS_ERROR) res = MJS_ERROR;
+      t->flags = 0;
+      if (t->fn != MJS_UNDEFINED && t->period > 0) {
+        t->expire += t->period;
+        if ((int32_t)(t->expire - now_ms) <= 0) t->expire = now_ms + t->period;
+        timer_link(vm, i);
+      } else {
+        t->fn = MJS_UNDEFINED;  // One-shot, or cleared by the callback
+      }
+      p = head;  // Callback could have changed the list, rescan it
+    }
+  }
+#endif
+#if MJS_TASK_POOL_SIZE > 0
+  if (vm->nesting == 0 && run_tasks(vm) == MJS_ERROR) res = MJS_ERROR;
+#endif
+  return res;
+}
+
 static val_t mjs_mk_c_func(struct vm *vm, cfn_t fn, const char *decl) {
   val_t v = mk_cfunc(vm);
   struct cfunc *cfunc = &vm->cfuncs[VAL_PAYLOAD(v)];
@@ -2260,6 +4588,7 @@ static val_t mjs_mk_c_func(struct vm *vm, cfn_t fn, const char *decl) {
   if (decl == NULL || decl[0] == '\0') return vm_err(vm, "wrong type spec");
   cfunc->fn = fn;
   cfunc->decl = decl;
+  vm->cfuncs_len++;
   return v;
 }
 
@@ -0,0 +1,182 @@
+// Benchmark suite for the interpreter: runs a set of microbenchmarks under
+// several pool configurations, and prints time per operation and the peak
+// usage of every pool. Build and run on Linux, with the default layout and
+// with the large heap one:
+//
+//    cc -O2 -I../src bench.c -o bench -lm && ./bench
+//    cc -O2 -I../src -DMJS_LARGE_HEAP=1 bench.c -o bench -lm && ./bench
+//
+// Switch case tables are cached with -DMJS_SWITCH_CACHE_SIZE=4, skipped
+// code is jumped over with -DMJS_SKIP_INDEX_SIZE=256. Benchmarks marked
+// with * are compiled once and run by mjs_run(), which keeps those caches
+// across runs
+
+#include <mjs3.c>
+
+#include <time.h>
+
+#define RUNS 10  // Times each benchmark script is run
+
+// Eight statements, to make a block that is skipped bigger
+#define STMTS8 "s += i; s -= i; s += i; s -= i; s += i; s -= i; s += i; s -= i; "
+
+struct bench {
+  const char *name;
+  const char *setup;  // Run once on a fresh VM
+  const char *code;   // Measured, NULL for the callbacks benchmark
+  int ops;            // Operations made by one run of the code
+};
+
+// Loops keep temporaries in block scopes, as assignment does not release
+// the value it overwrites
+static const struct bench s_benches[] = {
+    {"arithmetic", "",
+     "{ let i = 0, s = 0; while (i - 1000) { s += i * 2 - 1; i += 1; } }",
+     1000},
+    {"recursive calls",
+     "let fib = function(n) { let r = 1; if (n - 1) { if (n - 2) { "
+     "r = fib(n - 1) + fib(n - 2); } } return r; };",
+     "fib(12);", 287},
+    {"expressions", "let a = 3, b = 5;",
+     "{ let i = 0, s = 0; while (i - 1000) { "
+     "s = (a + b) * 2 - a * b % 7 + (b - a) / 2 + (i & 15) ^ 3 << 1; "
+     "i += 1; } }",
+     1000},
+    {"comparisons", "let n = 1000;",
+     "{ let i = 0, s = 0; while (i < n) { if (i >= 500) { s += 1; } "
+     "i += 1; } }",
+     1000},
+    {"for/continue", "",
+     "{ let s = 0; for (let i = 0; i < 1000; i++) { if (i & 1) { continue; } "
+     "s += i; } }",
+     1000},
+    {"ternary", "",
+     "{ let i = 0, s = 0; while (i - 1000) { s += i & 1 ? i : nop(i); "
+     "i += 1; } }",
+     1000},
+    {"switch", "",
+     "{ let i = 0, s = 0; while (i - 1000) { switch (i & 15) { "
+     "case 0: s += 1; break; case 1: s += 2; break; "
+     "case 2: s += 3; break; case 3: s += 4; break; "
+     "case 4: s += 5; break; case 5: s += 6; break; "
+     "case 6: s += 7; break; case 7: s += 8; break; "
+     "case 8: s += 9; break; case 9: s += 10; break; "
+     "case 10: s += 11; break; case 11: s += 12; break; "
+     "case 12: s += 13; break; case 13: s += 14; break; "
+     "case 14: s += 15; break; case 15: s += 16; break; "
+     "} i += 1; } }",
+     1000},
+    {"skip 1 stmt", "",
+     "{ let i = 0, s = 0; while (i - 1000) { if (i < 0) { s += i; } "
+     "i += 1; } }",
+     1000},
+    {"skip 64 stmts", "",
+     "{ let i = 0, s = 0; while (i - 1000) { if (i < 0) { " STMTS8 STMTS8
+     STMTS8 STMTS8 STMTS8 STMTS8 STMTS8 STMTS8 "} i += 1; } }",
+     1000},
+    {"property access", "let o = {a: 1, b: 2, c: 3, d: 4, e: 5};",
+     "{ let i = 0, s = 0; while (i - 1000) { s += o.a; i += 1; } }", 1000},
+    {"string concat", "let a = 'abc', b = 'def';",
+     "{ let i = 0; while (i - 1000) { if (1) { let s = a + b; } i += 1; } }",
+     1000},
+    {"ffi calls", "", "{ let i = 0; while (i - 1000) { nop(i); i += 1; } }",
+     1000},
+    {"callbacks", "let handler = function(x) { return x + 1; };", NULL, 1000},
+    {"pool churn", "",
+     "{ let i = 0; while (i - 1000) { let r = {id: i, state: 1, "
+     "count: 2}; i += 1; } }",
+     1000},
+};
+
+// Benchmarks that are run once more as compiled scripts
+static const char *s_compiled[] = {"switch", "skip 64 stmts"};
+
+struct config {
+  const char *name;
+  struct mjs_config cfg;
+};
+
+// clang-format off
+static const struct config s_configs[] = {
+  {"small", {32, 48, 64, 256, 8, 2048}},
+  {"medium", {128, 64, 512, 2048, 8, 16000}},
+#if MJS_LARGE_HEAP
+  {"large", {1024, 256, 16384, 65536, 8, 262144}},
+#endif
+};
+// clang-format on
+
+static int nop(int x) { return x; }
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int fail(struct mjs *vm, const struct bench *b) {
+  printf("%s: %s\n", b->name, vm->error_message);
+  return 1;
+}
+
+// Run one benchmark on a fresh VM, print time per operation and peak usage
+static int run(const struct config *c, const struct bench *b, int compiled) {
+  size_t size = mjs_arena_size(&c->cfg);
+  void *mem = malloc(size);
+  struct mjs *vm = mjs_create_in(mem, size, &c->cfg);
+  struct mjs_stats st;
+  char name[32];
+  double t;
+  int i, j, h = -1;
+
+  if (vm == NULL) return 1;
+  mjs_ffi(vm, "nop", (cfn_t) nop, "ii");
+  if (mjs_eval(vm, b->setup, -1) == MJS_ERROR) return fail(vm, b);
+  if (compiled && (h = mjs_compile(vm, b->code, -1)) < 0) return fail(vm, b);
+  t = now_ns();
+  for (i = 0; i < RUNS; i++) {
+    if (h >= 0) {
+      if (mjs_run(vm, h) == MJS_ERROR) return fail(vm, b);
+    } else if (b->code != NULL) {
+      if (mjs_eval(vm, b->code, -1) == MJS_ERROR) return fail(vm, b);
+    } else {
+      // Callbacks: the host calls a JS function directly
+      val_t fn = mjs_eval(vm, "handler", -1), arg = mjs_mk_num(1), res;
+      for (j = 0; j < b->ops; j++) {
+        if (mjs_call(vm, fn, 1, &arg, &res) == MJS_ERROR) return fail(vm, b);
+      }
+    }
+  }
+  t = now_ns() - t;
+  mjs_stats(vm, &st);
+  mjs_release(vm, h);
+  snprintf(name, sizeof(name), "%s%s", b->name, compiled ? "*" : "");
+  printf("%-8s %-16s %9.1f %6u %6u %8u %6u %6u\n", c->name, name,
+         t / RUNS / b->ops, (unsigned) st.objs_peak,
+         (unsigned) st.props_peak, (unsigned) st.strings_peak,
+         (unsigned) st.stack_peak, (unsigned) st.call_stack_peak);
+  mjs_destroy(vm);
+  free(mem);
+  return 0;
+}
+
+int main(void) {
+  size_t i, j, k;
+  int failed = 0;
+  printf("%s heap, %d-bit values\n", MJS_LARGE_HEAP ? "large" : "small",
+         (int) sizeof(val_t) * 8);
+  printf("%-8s %-16s %9s %6s %6s %8s %6s %6s\n", "config", "benchmark",
+         "ns/op", "objs", "props", "strings", "stack", "calls");
+  for (i = 0; i < ARRSIZE(s_configs); i++) {
+    for (j = 0; j < ARRSIZE(s_benches); j++) {
+      failed |= run(&s_configs[i], &s_benches[j], 0);
+    }
+    for (k = 0; k < ARRSIZE(s_compiled); k++) {
+      for (j = 0; j < ARRSIZE(s_benches); j++) {
+        if (strcmp(s_benches[j].name, s_compiled[k]) != 0) continue;
+        failed |= run(&s_configs[i], &s_benches[j], 1);
+      }
+    }
+  }
+  return failed;
+}
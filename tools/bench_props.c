@@ -0,0 +1,115 @@
+// Benchmark of property-heavy workloads: reading fields of a big config
+// object, and updating many small state records. Prints time per operation
+// and, where perf events are available, cache misses per operation.
+// Build and run on Linux:
+//
+//    cc -O2 -I../src bench_props.c -o bench_props -lm && ./bench_props
+
+#define MJS_OBJ_POOL_SIZE 200
+#define MJS_PROP_POOL_SIZE 2000
+#define MJS_STRING_POOL_SIZE 16000
+#define MJS_DATA_STACK_SIZE 32
+#define MJS_CALL_STACK_SIZE 32
+#include <mjs3.c>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NUM_FIELDS 48    // Fields of the config object
+#define NUM_RECORDS 100  // Number of state records
+#define ITERATIONS 200   // Loop iterations in a script
+
+static int perf_open(void) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t perf_read(int fd) {
+  uint64_t n = 0;
+  if (fd < 0 || read(fd, &n, sizeof(n)) != sizeof(n)) n = 0;
+  return n;
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Run `script` and report per-operation cost, `ops` operations per run
+static void bench(struct mjs *vm, const char *name, const char *script,
+                  int ops) {
+  int fd = perf_open(), runs = 20, i;
+  uint64_t misses = perf_read(fd);
+  double t = now_ns();
+  for (i = 0; i < runs; i++) {
+    if (mjs_eval(vm, script, -1) == MJS_ERROR) {
+      printf("%s: %s\n", name, vm->error_message);
+      exit(1);
+    }
+  }
+  t = now_ns() - t;
+  misses = perf_read(fd) - misses;
+  printf("%-16s %8.1f ns/op", name, t / runs / ops);
+  if (fd >= 0) {
+    printf("  %6.2f cache misses/op", (double) misses / runs / ops);
+    close(fd);
+  }
+  putchar('\n');
+}
+
+int main(void) {
+  static char buf[16000];
+  struct mjs *vm = mjs_create();
+  int i, n;
+
+  // A config object with many fields, plus a few records of state
+  n = snprintf(buf, sizeof(buf), "let cfg = {");
+  for (i = 0; i < NUM_FIELDS; i++) {
+    n += snprintf(buf + n, sizeof(buf) - n, "%sfield%d: %d", i ? ", " : "",
+                  i, i);
+  }
+  n += snprintf(buf + n, sizeof(buf) - n, "};");
+  for (i = 0; i < NUM_RECORDS; i++) {
+    n += snprintf(buf + n, sizeof(buf) - n,
+                  "let rec%d = {id: %d, state: 0, ts: 0, count: 0, "
+                  "value: 0};",
+                  i, i);
+  }
+  if (mjs_eval(vm, buf, n) == MJS_ERROR) {
+    printf("setup: %s\n", vm->error_message);
+    return 1;
+  }
+
+  // Read the last declared fields, which sit at the end of the key chains
+  snprintf(buf, sizeof(buf),
+           "{ let i = 0, s = 0; while (i - %d) { s += cfg.field0; "
+           "s += cfg.field%d; i += 1; } }",
+           ITERATIONS, NUM_FIELDS / 2);
+  bench(vm, "config read", buf, ITERATIONS * 2);
+
+  // Update records, looked up through the global scope
+  snprintf(buf, sizeof(buf),
+           "{ let j = 0; while (j - %d) { rec0.count += 1; rec%d.value += j; "
+           "rec%d.ts = j; j += 1; } }",
+           ITERATIONS, NUM_RECORDS / 2, NUM_RECORDS - 1);
+  bench(vm, "record update", buf, ITERATIONS * 3);
+
+  // Create and release temporary records
+  snprintf(buf, sizeof(buf),
+           "{ let k = 0; while (k - %d) { let r = {id: k, state: 1, "
+           "ts: 2, count: 3, value: 4}; r.value += r.id; k += 1; } }",
+           ITERATIONS);
+  bench(vm, "record churn", buf, ITERATIONS);
+
+  mjs_destroy(vm);
+  return 0;
+}
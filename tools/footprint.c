@@ -0,0 +1,119 @@
+// Memory footprint checker. Prints the size of the VM structure, of the
+// pool entries and of the default arena, and the peak pool usage of a fixed
+// script corpus. Given a baseline file, fails if any of these grew beyond
+// it. Sizes depend on the host ABI, the checked-in baseline is for 64-bit
+// Linux. Build and run on Linux, see footprint.sh for all configurations:
+//
+//    cc -O2 -I../src footprint.c -o footprint -lm
+//    ./footprint footprint.txt   # Check against the baseline
+//    ./footprint                 # Print current values
+
+#include <mjs3.c>
+
+#define MAX_METRICS 64
+
+struct metric {
+  char name[48];
+  unsigned long value;
+};
+
+static struct metric s_metrics[MAX_METRICS];
+static int s_num_metrics;
+static char s_config[64];  // Name of the macro configuration
+
+static void add(const char *name, unsigned long value) {
+  struct metric *m = &s_metrics[s_num_metrics++];
+  snprintf(m->name, sizeof(m->name), "%s", name);
+  m->value = value;
+}
+
+// Scripts that exercise the pools the way field scripts do
+static const char *s_corpus[][2] = {
+    {"blink", "let on = 0; let toggle = function() { on = 1 - on; "
+              "return on; }; toggle(); toggle();"},
+    {"config", "let cfg = {pin: 16, period: 500, name: 'led', "
+               "retries: 3, level: 1, mode: 'out'}; cfg.period;"},
+    {"records", "let a = {id: 1, v: 0}, b = {id: 2, v: 0}, "
+                "c = {id: 3, v: 0}; { let i = 0; while (i - 10) { "
+                "let r = {id: i, v: a.id + b.id + c.id}; i += 1; } }"},
+    {"strings", "let greet = function(n) { return 'hello, ' + n; }; "
+                "let s = greet('world'); s.length;"},
+    {"calls", "let f = function(n) { let r = 1; if (n - 1) { "
+              "r = f(n - 1) + 1; } return r; }; f(8);"},
+};
+
+static int measure(void) {
+  struct mjs_config cfg = {64, 64, 64, 256, 8, 4096};
+  size_t i, size = mjs_arena_size(&cfg);
+  void *mem = malloc(size);
+  char name[48];
+
+  add("vm_size", (unsigned long) sizeof(struct vm));
+  add("obj_bytes", (unsigned long) sizeof(struct obj));
+  add("prop_bytes", (unsigned long) (2 * sizeof(val_t) + sizeof(ind_t) + 1));
+  add("arena_size", (unsigned long) mjs_arena_size(NULL));
+  for (i = 0; i < ARRSIZE(s_corpus); i++) {
+    struct mjs *vm = mjs_create_in(mem, size, &cfg);
+    struct mjs_stats st;
+    if (vm == NULL || mjs_eval(vm, s_corpus[i][1], -1) == MJS_ERROR) {
+      printf("%s: %s\n", s_corpus[i][0], vm ? vm->error_message : "no VM");
+      return 1;
+    }
+    mjs_stats(vm, &st);
+#define PEAK(x)                                                  \
+  snprintf(name, sizeof(name), "%s.%s", s_corpus[i][0], #x);     \
+  add(name, (unsigned long) st.x);
+    PEAK(objs_peak)
+    PEAK(props_peak)
+    PEAK(strings_peak)
+    PEAK(stack_peak)
+    PEAK(call_stack_peak)
+#undef PEAK
+  }
+  free(mem);
+  return 0;
+}
+
+// Compare against the baseline lines of this configuration:
+// `config metric value`. Unknown metrics are reported, not failed
+static int check(const char *file) {
+  char cfg[64], name[48];
+  unsigned long limit;
+  int i, failed = 0, found = 0;
+  FILE *fp = fopen(file, "r");
+  if (fp == NULL) {
+    printf("cannot open %s\n", file);
+    return 1;
+  }
+  while (fscanf(fp, "%63s %47s %lu", cfg, name, &limit) == 3) {
+    if (strcmp(cfg, s_config) != 0) continue;
+    for (i = 0; i < s_num_metrics; i++) {
+      if (strcmp(s_metrics[i].name, name) != 0) continue;
+      found++;
+      if (s_metrics[i].value > limit) {
+        printf("%s %s: %lu, baseline %lu\n", s_config, name,
+               s_metrics[i].value, limit);
+        failed++;
+      }
+    }
+  }
+  fclose(fp);
+  if (found < s_num_metrics) {
+    printf("%s: %d metrics not in the baseline\n", s_config,
+           s_num_metrics - found);
+  }
+  printf("%s: %s\n", s_config, failed ? "FAILED" : "ok");
+  return failed ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+  int i;
+  snprintf(s_config, sizeof(s_config), "heap%d-timers%d-tasks%d",
+           MJS_LARGE_HEAP ? 64 : 32, MJS_TIMER_POOL_SIZE, MJS_TASK_POOL_SIZE);
+  if (measure() != 0) return 1;
+  if (argc > 1) return check(argv[1]);
+  for (i = 0; i < s_num_metrics; i++) {
+    printf("%s %s %lu\n", s_config, s_metrics[i].name, s_metrics[i].value);
+  }
+  return 0;
+}
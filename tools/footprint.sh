@@ -0,0 +1,18 @@
+#!/bin/sh
+# Checks memory footprint of every configuration against footprint.txt.
+# Run from the tools directory. With -u, rewrites the baseline instead.
+# API functions are static, and the checker does not call all of them
+cflags="-O2 -W -Wall -Wextra -Wno-unused-function -I../src"
+status=0
+[ "$1" = "-u" ] && : > footprint.txt
+for flags in "-DMJS_LARGE_HEAP=0" "-DMJS_TIMER_POOL_SIZE=4" \
+             "-DMJS_TASK_POOL_SIZE=4" "-DMJS_LARGE_HEAP=1"; do
+  cc $cflags $flags footprint.c -o footprint -lm || exit 1
+  if [ "$1" = "-u" ]; then
+    ./footprint >> footprint.txt || status=1
+  else
+    ./footprint footprint.txt || status=1
+  fi
+done
+rm -f footprint
+exit $status
@@ -0,0 +1,151 @@
+// Runs a script and dumps the VM heap as JSON, for offline analysis. Entries
+// that cannot be reached from the roots are leaked, they are flagged in the
+// dump and summarised on stderr. Build and run on Linux:
+//
+//    cc -O2 -I../src heap_snapshot.c -o heap_snapshot -lm
+//    ./heap_snapshot script.js > heap.json
+//
+// Pass the pool sizes of the target with -D, e.g. -DMJS_PROP_POOL_SIZE=200
+
+#ifndef MJS_OBJ_POOL_SIZE
+#define MJS_OBJ_POOL_SIZE 100
+#endif
+#ifndef MJS_PROP_POOL_SIZE
+#define MJS_PROP_POOL_SIZE 500
+#endif
+#ifndef MJS_STRING_POOL_SIZE
+#define MJS_STRING_POOL_SIZE 8000
+#endif
+#ifndef MJS_TIMER_POOL_SIZE
+#define MJS_TIMER_POOL_SIZE 4
+#endif
+#include <mjs3.c>
+
+#define MAX_ITEMS 65536
+
+static struct mjs_heap_item s_items[MAX_ITEMS];
+static int s_num_items;
+
+static void collect(struct mjs *vm, const struct mjs_heap_item *it,
+                    void *ctx) {
+  (void) vm;
+  (void) ctx;
+  if (s_num_items < MAX_ITEMS) s_items[s_num_items++] = *it;
+}
+
+// Mark the object or string `v` reachable. Return 1 if it was not yet
+static int mark(uint8_t *objs, uint8_t *strs, val_t v) {
+  uint8_t *p = NULL;
+  mjs_type_t t = mjs_type(v);
+  if (t == MJS_TYPE_OBJECT) p = &objs[VAL_PAYLOAD(v)];
+  if (t == MJS_TYPE_STRING || t == MJS_TYPE_FUNCTION) {
+    p = &strs[VAL_PAYLOAD(v)];
+  }
+  if (p == NULL || *p) return 0;
+  *p = 1;
+  return 1;
+}
+
+static int is_reachable(const uint8_t *objs, const uint8_t *strs,
+                        const struct mjs_heap_item *it) {
+  switch (it->kind) {
+    case MJS_HEAP_OBJ: return objs[it->id];
+    case MJS_HEAP_PROP: return objs[VAL_PAYLOAD(it->owner)];
+    case MJS_HEAP_STRING: return strs[it->id];
+    default: return 1;
+  }
+}
+
+static const char *s_kinds[] = {"root", "obj", "prop", "string", "cfunc"};
+
+static void print_str(struct mjs *vm, val_t v) {
+  len_t i, len;
+  const char *p = mjs_to_str(vm, v, &len);
+  putchar('"');
+  for (i = 0; i < len; i++) {
+    unsigned char c = (unsigned char) p[i];
+    if (c == '"' || c == '\\') {
+      printf("\\%c", c);
+    } else if (c < 0x20 || c > 0x7e) {
+      printf("\\u%04x", c);
+    } else {
+      putchar(c);
+    }
+  }
+  putchar('"');
+}
+
+int main(int argc, char **argv) {
+  static char buf[65536];
+  struct mjs *vm = mjs_create();
+  struct mjs_stats st;
+  uint8_t *objs, *strs;
+  unsigned long leaked[5] = {0, 0, 0, 0, 0}, bytes = 0;
+  FILE *fp;
+  size_t n;
+  int i, changed;
+
+  if (argc != 2 || (fp = fopen(argv[1], "rb")) == NULL) {
+    fprintf(stderr, "usage: %s script.js > heap.json\n", argv[0]);
+    return 1;
+  }
+  n = fread(buf, 1, sizeof(buf), fp);
+  fclose(fp);
+  if (mjs_eval(vm, buf, (int) n) == MJS_ERROR) {
+    fprintf(stderr, "%s: %s\n", argv[1], vm->error_message);
+  }
+  mjs_heap_walk(vm, collect, NULL);
+
+  // Mark everything reachable from the roots, following props of the
+  // reachable objects until nothing new is found
+  objs = (uint8_t *) calloc(vm->cfg.obj_pool_size, 1);
+  strs = (uint8_t *) calloc(vm->cfg.string_pool_size, 1);
+  for (i = 0; i < s_num_items; i++) {
+    if (s_items[i].kind == MJS_HEAP_ROOT) mark(objs, strs, s_items[i].value);
+  }
+  do {
+    changed = 0;
+    for (i = 0; i < s_num_items; i++) {
+      struct mjs_heap_item *it = &s_items[i];
+      if (it->kind != MJS_HEAP_PROP || !objs[VAL_PAYLOAD(it->owner)]) continue;
+      changed |= mark(objs, strs, it->key);
+      changed |= mark(objs, strs, it->value);
+    }
+  } while (changed);
+
+  mjs_stats(vm, &st);
+  printf("{\"stats\": {\"objs\": %u, \"props\": %u, \"cfuncs\": %u, "
+         "\"strings\": %u},\n \"items\": [\n",
+         (unsigned) st.objs, (unsigned) st.props, (unsigned) st.cfuncs,
+         (unsigned) st.strings);
+  for (i = 0; i < s_num_items; i++) {
+    struct mjs_heap_item *it = &s_items[i];
+    int live = is_reachable(objs, strs, it);
+    printf("  {\"kind\": \"%s\", \"id\": %lu, \"size\": %lu, \"live\": %s",
+           s_kinds[it->kind], it->id, it->size, live ? "true" : "false");
+    if (it->kind == MJS_HEAP_PROP) {
+      printf(", \"owner\": %lu, \"key\": ",
+             (unsigned long) VAL_PAYLOAD(it->owner));
+      print_str(vm, it->key);
+    }
+    if (it->kind != MJS_HEAP_OBJ) {
+      printf(", \"type\": \"%s\", \"value\": ", mjs_typeof(it->value));
+      if (mjs_type(it->value) == MJS_TYPE_STRING) {
+        print_str(vm, it->value);
+      } else {
+        printf("\"%s\"", tostr(vm, it->value));
+      }
+    }
+    printf("}%s\n", i + 1 < s_num_items ? "," : "");
+    if (!live) leaked[it->kind]++, bytes += it->size;
+  }
+  printf("]}\n");
+
+  fprintf(stderr, "leaked: %lu objs, %lu props, %lu strings, %lu bytes\n",
+          leaked[MJS_HEAP_OBJ], leaked[MJS_HEAP_PROP],
+          leaked[MJS_HEAP_STRING], bytes);
+  free(objs);
+  free(strs);
+  mjs_destroy(vm);
+  return leaked[MJS_HEAP_OBJ] + leaked[MJS_HEAP_STRING] > 0 ? 2 : 0;
+}
@@ -0,0 +1,206 @@
+// Pool sizing analyzer. Runs a script with roomy pools, drives its timers
+// and tasks over a simulated clock, and prints a config header with the
+// high-water mark of every pool and stack, plus a safety margin. Timers or
+// tasks the script does not use get a zero pool, and the built-in functions
+// that come with them are left out of the other pools.
+// C functions the script imports are stubbed: declare each one with -f,
+// they return values from the -i list in turn. Build and run on Linux:
+//
+//    cc -O2 -I../src poolsize.c -o poolsize -lm
+//    ./poolsize -f write/2 -i 0,512,1023 -t 60000 app.js > mjs_config.h
+//
+// Scripts given after the first one are run as tasks.
+
+#define MJS_TIMER_POOL_SIZE 16
+#define MJS_TASK_POOL_SIZE 8
+#define MJS_CFUNC_POOL_SIZE 64
+#include <mjs3.c>
+
+#define MAX_STUBS 32
+#define MAX_INPUTS 64
+
+static char s_decls[MAX_STUBS][8];  // FFI declarations must outlive the VM
+static double s_inputs[MAX_INPUTS] = {0};
+static int s_num_inputs = 1, s_next_input;
+
+// Stub for all imported C functions, returns the next simulated input.
+// Extra arguments are ignored by the calling convention
+static int stub(int a, int b, int c, int d, int e, int f) {
+  (void) a, (void) b, (void) c, (void) d, (void) e, (void) f;
+  return (int) s_inputs[s_next_input++ % s_num_inputs];
+}
+
+static char *load(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  char *buf = NULL;
+  long n;
+  if (fp != NULL && fseek(fp, 0, SEEK_END) == 0 && (n = ftell(fp)) >= 0) {
+    buf = (char *) calloc(1, (size_t) n + 1);
+    fseek(fp, 0, SEEK_SET);
+    if (fread(buf, 1, (size_t) n, fp) != (size_t) n) buf[0] = '\0';
+  }
+  if (fp != NULL) fclose(fp);
+  return buf;
+}
+
+// Built-in functions of a pool, and the pool entries they take
+struct builtins {
+  const char *const *names;              // Global names they are set as
+  val_t keys[4], vals[4];                // Their props, found by the walk
+  int n;                                 // Number of props found
+  unsigned long cfuncs, props, strings;  // Pool entries, string bytes
+};
+
+static const char *const s_timer_fns[] = {"setTimeout", "setInterval",
+                                          "clearTimeout", "clearInterval",
+                                          NULL};
+static const char *const s_task_fns[] = {"sleep", "yield", NULL};
+
+static void walk_builtins(struct mjs *vm, const struct mjs_heap_item *it,
+                          void *ctx) {
+  struct builtins *b = (struct builtins *) ctx;
+  int i;
+  if (it->kind == MJS_HEAP_PROP && it->owner == mjs_get_global(vm)) {
+    len_t len;
+    const char *key = mjs_to_str(vm, it->key, &len);
+    for (i = 0; b->names[i] != NULL && b->n < 4; i++) {
+      if (strlen(b->names[i]) != len || memcmp(key, b->names[i], len) != 0) {
+        continue;
+      }
+      b->keys[b->n] = it->key;
+      b->vals[b->n++] = it->value;
+      b->props++;
+    }
+  }
+  for (i = 0; i < b->n; i++) {
+    if (it->kind == MJS_HEAP_STRING && it->value == b->keys[i]) {
+      b->strings += it->size;
+    } else if (it->kind == MJS_HEAP_CFUNC && it->value == b->vals[i]) {
+      b->cfuncs++;  // clearTimeout and clearInterval share one
+      break;
+    }
+  }
+}
+
+// Timers and tasks in use, sampled after every step
+static void count_timers(struct mjs *vm, int *timers_peak, int *tasks_peak) {
+  int i, timers = 0, tasks = 0;
+  for (i = 0; i < (int) ARRSIZE(vm->timers); i++) {
+    if (vm->timers[i].fn != MJS_UNDEFINED) timers++;
+  }
+  for (i = 0; i < (int) ARRSIZE(vm->tasks); i++) {
+    if (vm->tasks[i].rs.buf != NULL) tasks++;
+  }
+  if (timers > *timers_peak) *timers_peak = timers;
+  if (tasks > *tasks_peak) *tasks_peak = tasks;
+}
+
+static unsigned long margin(unsigned long n, int percent) {
+  return n + (n * (unsigned long) percent + 99) / 100;
+}
+
+static int usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-f name/nargs]... [-i v1,v2,...] [-t ms] [-m percent] "
+          "script.js [task.js ...]\n",
+          prog);
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  // Roomy pools, but within the 16-bit index limit of the default layout
+  struct mjs_config cfg = {1024, 256, 4096, 16384, MJS_CFUNC_POOL_SIZE,
+                           60000};
+  size_t size = mjs_arena_size(&cfg);
+  struct mjs *vm = mjs_create_in(malloc(size), size, &cfg);
+  struct mjs_stats st;
+  struct builtins timer_fns, task_fns;
+  unsigned long duration = 0, t;
+  int i, percent = 25, num_stubs = 0, timers_peak = 0, tasks_peak = 0;
+  char *script;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i += 2) {
+    if (i + 1 >= argc) return usage(argv[0]);
+    if (strcmp(argv[i], "-f") == 0 && num_stubs < MAX_STUBS) {
+      char name[64], *decl = s_decls[num_stubs++];
+      int nargs = 0, j;
+      if (sscanf(argv[i + 1], "%63[^/]/%d", name, &nargs) < 1 || nargs < 0 ||
+          nargs > 6) {
+        return usage(argv[0]);
+      }
+      decl[0] = 'i';
+      for (j = 0; j < nargs; j++) decl[j + 1] = 'i';
+      if (mjs_ffi(vm, name, (cfn_t) stub, decl) == MJS_ERROR) {
+        fprintf(stderr, "%s: %s\n", name, vm->error_message);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-i") == 0) {
+      char *s = argv[i + 1], *end;
+      for (s_num_inputs = 0; s_num_inputs < MAX_INPUTS; s = end + 1) {
+        s_inputs[s_num_inputs++] = strtod(s, &end);
+        if (*end != ',') break;
+      }
+    } else if (strcmp(argv[i], "-t") == 0) {
+      duration = strtoul(argv[i + 1], NULL, 10);
+    } else if (strcmp(argv[i], "-m") == 0) {
+      percent = atoi(argv[i + 1]);
+    } else {
+      return usage(argv[0]);
+    }
+  }
+  if (i >= argc || vm == NULL) return usage(argv[0]);
+  memset(&timer_fns, 0, sizeof(timer_fns));
+  memset(&task_fns, 0, sizeof(task_fns));
+  timer_fns.names = s_timer_fns;
+  task_fns.names = s_task_fns;
+  mjs_heap_walk(vm, walk_builtins, &timer_fns);
+  mjs_heap_walk(vm, walk_builtins, &task_fns);
+
+  // The first script runs as the main one, the rest as tasks
+  if ((script = load(argv[i])) == NULL) return usage(argv[0]);
+  if (mjs_eval(vm, script, -1) == MJS_ERROR) {
+    fprintf(stderr, "%s: %s\n", argv[i], vm->error_message);
+    return 1;
+  }
+  for (i++; i < argc; i++) {
+    if ((script = load(argv[i])) == NULL || mjs_spawn(vm, script, -1) < 0) {
+      fprintf(stderr, "%s: %s\n", argv[i], script ? vm->error_message : "?");
+      return 1;
+    }
+  }
+  count_timers(vm, &timers_peak, &tasks_peak);
+  for (t = 0; t <= duration; t += MJS_TIMER_TICK_MS) {
+    if (mjs_poll(vm, (uint32_t) t) == MJS_ERROR) {
+      fprintf(stderr, "at %lu ms: %s\n", t, vm->error_message);
+      return 1;
+    }
+    count_timers(vm, &timers_peak, &tasks_peak);
+  }
+
+  // The call stack needs a spare slot, see create_scope()
+  mjs_stats(vm, &st);
+  if (timers_peak == 0) {
+    st.cfuncs -= timer_fns.cfuncs;
+    st.props_peak -= timer_fns.props;
+    st.strings_peak -= timer_fns.strings;
+  }
+  if (tasks_peak == 0) {
+    st.cfuncs -= task_fns.cfuncs;
+    st.props_peak -= task_fns.props;
+    st.strings_peak -= task_fns.strings;
+  }
+  printf("// Pool sizes measured by tools/poolsize.c over %lu ms, "
+         "plus %d%%\n",
+         duration, percent);
+  printf("#define MJS_DATA_STACK_SIZE %lu\n", margin(st.stack_peak, percent));
+  printf("#define MJS_CALL_STACK_SIZE %lu\n",
+         margin(st.call_stack_peak + 1UL, percent));
+  printf("#define MJS_OBJ_POOL_SIZE %lu\n", margin(st.objs_peak, percent));
+  printf("#define MJS_PROP_POOL_SIZE %lu\n", margin(st.props_peak, percent));
+  printf("#define MJS_CFUNC_POOL_SIZE %lu\n", (unsigned long) st.cfuncs);
+  printf("#define MJS_STRING_POOL_SIZE %lu\n",
+         margin(st.strings_peak, percent));
+  printf("#define MJS_TIMER_POOL_SIZE %lu\n", margin(timers_peak, percent));
+  printf("#define MJS_TASK_POOL_SIZE %d\n", tasks_peak);
+  return 0;
+}
@@ -0,0 +1,60 @@
+// Runs a script with the profiler on and prints its flat profile, or its
+// collapsed stacks for flamegraph.pl. Times are in microseconds, lines in
+// functions are counted from the line of the `function` keyword.
+// Build and run on Linux:
+//
+//    cc -O2 -I../src profile.c -o profile -lm
+//    ./profile script.js
+//    ./profile -c script.js | flamegraph.pl > profile.svg
+
+#ifndef MJS_PROFILE_SIZE
+#define MJS_PROFILE_SIZE 1024
+#endif
+#ifndef MJS_PROFILE_FUNCS
+#define MJS_PROFILE_FUNCS 64
+#endif
+#ifndef MJS_OBJ_POOL_SIZE
+#define MJS_OBJ_POOL_SIZE 100
+#endif
+#ifndef MJS_PROP_POOL_SIZE
+#define MJS_PROP_POOL_SIZE 500
+#endif
+#ifndef MJS_STRING_POOL_SIZE
+#define MJS_STRING_POOL_SIZE 8000
+#endif
+#include <mjs3.c>
+
+#include <time.h>
+
+static uint32_t micros(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static void print_line(const char *line, void *ctx) {
+  fputs(line, (FILE *) ctx);
+}
+
+int main(int argc, char **argv) {
+  static char buf[65536];
+  struct mjs *vm = mjs_create();
+  int collapsed = argc == 3 && strcmp(argv[1], "-c") == 0;
+  FILE *fp;
+  size_t n;
+
+  if (argc != 2 + collapsed ||
+      (fp = fopen(argv[argc - 1], "rb")) == NULL) {
+    fprintf(stderr, "usage: %s [-c] script.js\n", argv[0]);
+    return 1;
+  }
+  n = fread(buf, 1, sizeof(buf), fp);
+  fclose(fp);
+  mjs_set_clock(vm, micros);
+  if (mjs_eval(vm, buf, (int) n) == MJS_ERROR) {
+    fprintf(stderr, "%s: %s\n", argv[argc - 1], vm->error_message);
+  }
+  mjs_profile_dump(vm, collapsed, print_line, stdout);
+  mjs_destroy(vm);
+  return 0;
+}
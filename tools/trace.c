@@ -0,0 +1,121 @@
+// Decodes a trace buffer saved from a VM built with MJS_TRACE, see
+// mjs_set_trace(), and prints its events from the oldest to the newest.
+// It can also run a script with tracing on and save its trace.
+// Build and run on Linux:
+//
+//    cc -O2 -I../src trace.c -o trace -lm
+//    ./trace -r script.js trace.bin   # Run script.js, save trace.bin
+//    ./trace trace.bin                # Print events
+
+#define MJS_TRACE 1
+#ifndef MJS_OBJ_POOL_SIZE
+#define MJS_OBJ_POOL_SIZE 100
+#endif
+#ifndef MJS_PROP_POOL_SIZE
+#define MJS_PROP_POOL_SIZE 500
+#endif
+#ifndef MJS_STRING_POOL_SIZE
+#define MJS_STRING_POOL_SIZE 8000
+#endif
+#include <mjs3.c>
+
+#include <time.h>
+
+#define MAX_EVENTS 4096
+
+static const char *s_events[] = {"stmt", "push", "drop", "op",
+                                 "call", "ffi",  "error"};
+static const char *s_types[] = {"undefined", "null",   "true",   "false",
+                                "string",    "object", "array",  "function",
+                                "number",    "error",  "cfunc",  "ref"};
+
+static uint32_t micros(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static int record(const char *script, const char *out) {
+  static char buf[65536];
+  static uint32_t mem[(sizeof(struct mjs_trace_hdr) +
+                       MAX_EVENTS * sizeof(struct mjs_trace_event)) /
+                      sizeof(uint32_t)];
+  struct mjs *vm = mjs_create();
+  FILE *fp = fopen(script, "rb");
+  size_t n;
+  if (fp == NULL) return 1;
+  n = fread(buf, 1, sizeof(buf), fp);
+  fclose(fp);
+  mjs_set_clock(vm, micros);
+  mjs_set_trace(vm, mem, sizeof(mem));
+  if (mjs_eval(vm, buf, (int) n) == MJS_ERROR) {
+    fprintf(stderr, "%s: %s\n", script, vm->error_message);
+  }
+  mjs_destroy(vm);
+  if ((fp = fopen(out, "wb")) == NULL) return 1;
+  fwrite(mem, 1, sizeof(mem), fp);
+  fclose(fp);
+  return 0;
+}
+
+static void print_op(uint32_t op) {
+  int i;
+  for (i = 24; i >= 0; i -= 8) {
+    unsigned c = (op >> i) & 0xff;
+    if (c >= 0x21 && c <= 0x7e) {
+      putchar((int) c);
+    } else if (c != 0) {
+      printf("#%u", c);
+    }
+  }
+}
+
+static int decode(const char *file) {
+  struct mjs_trace_hdr h;
+  struct mjs_trace_event e;
+  FILE *fp = fopen(file, "rb");
+  uint32_t i, first;
+  if (fp == NULL || fread(&h, sizeof(h), 1, fp) != 1 ||
+      h.magic != MJS_TRACE_MAGIC || h.size == 0) {
+    fprintf(stderr, "%s: not a trace\n", file);
+    return 1;
+  }
+  // The ring wraps around once more than `size` events are written
+  first = h.head > h.size ? h.head - h.size : 0;
+  printf("%u events, showing %u\n", (unsigned) h.head,
+         (unsigned) (h.head - first));
+  printf("%10s %5s %4s %4s  %-6s %s\n", "time", "line", "sp", "csp", "event",
+         "value");
+  for (i = first; i < h.head; i++) {
+    long off = (long) (sizeof(h) + (i % h.size) * sizeof(e));
+    if (fseek(fp, off, SEEK_SET) != 0 || fread(&e, sizeof(e), 1, fp) != 1) {
+      fprintf(stderr, "%s: truncated\n", file);
+      return 1;
+    }
+    printf("%10u %5u %4u %4u  %-6s ", (unsigned) e.time, (unsigned) e.line,
+           (unsigned) e.sp, (unsigned) e.csp,
+           e.event < ARRSIZE(s_events) ? s_events[e.event] : "?");
+    if (e.event == MJS_TRACE_OP) {
+      print_op(e.payload);
+    } else if (e.event != MJS_TRACE_STMT && e.event != MJS_TRACE_ERROR) {
+      printf("%s", e.type < ARRSIZE(s_types) ? s_types[e.type] : "?");
+      if (e.type == MJS_TYPE_NUMBER) {
+        float f;
+        memcpy(&f, &e.payload, sizeof(f));
+        printf(" %g", f);
+      } else if (e.type >= MJS_TYPE_STRING) {
+        printf(" @%u", (unsigned) e.payload);
+      }
+    }
+    putchar('\n');
+  }
+  fclose(fp);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 4 && strcmp(argv[1], "-r") == 0) return record(argv[2], argv[3]);
+  if (argc == 2) return decode(argv[1]);
+  fprintf(stderr, "usage: %s [-r script.js] trace.bin\n", argv[0]);
+  return 1;
+}